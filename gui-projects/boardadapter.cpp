@@ -76,8 +76,8 @@ QString BoardAdapter::getPieceLetter(int pos) const
 int BoardAdapter::getMark(int pos) const
 {
     int mark = 0;
-    if (!m_board.getHistList().empty()) {
-        auto lastMove = m_board.getHistList().back().move;
+    if (m_board.getPly() > 0) {
+        auto lastMove = m_board.getUndoList().back().move;
         if (lastMove.from == pos) {
             mark = 1;
         } else if (lastMove.dest == pos) {
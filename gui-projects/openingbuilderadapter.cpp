@@ -82,6 +82,7 @@ void OpeningBuilderAdapter::create(QString folder, QString openingPath, QString
     paramMap["maxply"] = QString("%1").arg(addToLength).toStdString();
     paramMap["minply"] = QString("%1").arg(minGameLength).toStdString();
     paramMap["mingame"] = QString("%1").arg(repeatCnt).toStdString();
+    paramMap["threads"] = QString("%1").arg(QThread::idealThreadCount()).toStdString();
 
     if (sides != 3) {
         if (sides == 1) {
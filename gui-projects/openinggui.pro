@@ -15,6 +15,7 @@ DEFINES += QT_DEPRECATED_WARNINGS
 
 SOURCES += main.cpp \
     ../source/GameReader.cpp \
+    ../source/OpBitboard.cpp \
     ../source/OpBoard.cpp \
     ../source/OpBook.cpp \
     ../source/OpBookBuilder.cpp \
@@ -39,6 +40,7 @@ else: unix:!android: target.path = /opt/$${TARGET}/bin
 
 HEADERS += \
     ../source/GameReader.h \
+    ../source/OpBitboard.h \
     ../source/OpBoard.h \
     ../source/OpBook.h \
     ../source/OpBookBuilder.h \
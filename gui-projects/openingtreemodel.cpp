@@ -98,13 +98,14 @@ bool OpeningTreeModel::buildTree(TreeItem* treeItem, opening::OpeningBoard& boar
 
 //        treeItem->value = m_opBook.getValue(idx, sd);
 
-        auto val = m_opBook.getValueByKeyFromMainData(board.key(), sd);
+        auto key = m_opBook.bookKey(board);
+        auto val = m_opBook.getValueByKeyFromMainData(key, sd);
         if (val < 0) {
             return false;
         }
 
         treeItem->value = val;
-        treeItem->learntValue = m_opBook.getValueByKeyFromLearntData(board.key(), sd);;
+        treeItem->learntValue = m_opBook.getValueByKeyFromLearntData(key, sd);;
 
         treeItem->prop |= TreeItem::Prop_hasValue;
         r = true;
@@ -113,18 +114,31 @@ bool OpeningTreeModel::buildTree(TreeItem* treeItem, opening::OpeningBoard& boar
     opening::MoveList moveList;
     board.gen(moveList, board.side);
 
+    // values of all children are looked up in one pass, moves out of the book are skipped
+    int values[opening::MoveList::MaxMoveNumber];
+    if (sameSide) {
+        u64 keys[opening::MoveList::MaxMoveNumber];
+        for(int i = 0; i < moveList.end; i++) {
+            keys[i] = m_opBook.bookKeyAfterMove(board, moveList.list[i]);
+        }
+        m_opBook.getValuesByKeysFromMainData(keys, values, moveList.end, sd);
+    }
+
+    // moves are checked without being made, only legal ones are made to go down the tree
+    opening::CheckInfo checkInfo(board, side);
     for(int i = 0; i < moveList.end; i++) {
+        if ((sameSide && values[i] < 0) || !checkInfo.isLegal(moveList.list[i])) {
+            continue;
+        }
         auto move = moveList.list[i];
         board.make(move);
-        if (!board.isIncheck(side)) {
-            auto child = new TreeItem(move.from, move.dest);
-            if (buildTree(child, board, sd, moreply)) {
-                treeItem->addChild(child);
-                treeItem->prop |= TreeItem::Prop_hasExpanded;
-                r = true;
-            } else {
-                delete child;
-            }
+        auto child = new TreeItem(move.from, move.dest);
+        if (buildTree(child, board, sd, moreply)) {
+            treeItem->addChild(child);
+            treeItem->prop |= TreeItem::Prop_hasExpanded;
+            r = true;
+        } else {
+            delete child;
         }
         board.takeBack();
     }
@@ -316,5 +330,5 @@ void OpeningTreeModel::updateValue(const QModelIndex &index, const QVariant &val
     getLine(node, moves, board);
 
     int v = (int)value.toDouble();
-    m_opBook.updateValue(board.key(), v, m_showingSide, saveTo);
+    m_opBook.updateValue(m_opBook.bookKey(board), v, m_showingSide, saveTo);
 }
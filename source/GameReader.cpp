@@ -26,19 +26,20 @@
 
 #include "GameReader.h"
 
-#include <regex>
 #include <fstream>
 #include <sstream>
 #include <assert.h>
+#include <cstring>
+#include <algorithm>
 
 #include "OpBoard.h"
 
 
 using namespace opening;
 
-GameReader::GameReader(const std::string& path)
+GameReader::GameReader(const std::string& path, bool mmapMode)
 {
-    init(path);
+    init(path, mmapMode);
 }
 
 std::string GameReader::loadFile(const std::string& fileName) {
@@ -51,159 +52,199 @@ std::string GameReader::loadFile(const std::string& fileName) {
     return content;
 }
 
-bool GameReader::init(const std::string& path) {
-    gameStringVector.clear();
+const char* GameReader::findString(const char* from, const char* end, const char* str) {
+    return std::search(from, end, str, str + strlen(str));
+}
+
+bool GameReader::init(const std::string& path, bool mmapMode) {
+    mappedFile.close();
+    content.clear();
+    contentEnd = nextGamePos = nullptr;
     workingGameIdx = 0;
 
-    std::string content = loadFile(path);
+    const char* contentStart;
+    if (mmapMode && mappedFile.open(path)) {
+        contentStart = mappedFile.getData();
+        contentEnd = contentStart + mappedFile.getSize();
+    } else {
+        content = loadFile(path);
+        contentStart = content.c_str();
+        contentEnd = contentStart + content.length();
+    }
 
-    std::string seperator = "[Event";
-    if (content.find(seperator, 0) == std::string::npos) {
+    seperator = "[Event";
+    auto pos = findString(contentStart, contentEnd, seperator);
+    if (pos == contentEnd) {
         seperator = "FORMAT";
-        if (content.find("START{", 0) == std::string::npos) {
+        if (findString(contentStart, contentEnd, "START{") == contentEnd) {
+            contentEnd = nullptr;
             return false;
         }
-    }
-
-    std::string::size_type prev_pos = 0, pos = 0;
-    bool first = true;
-
-    while ((pos = content.find(seperator, pos)) != std::string::npos) {
-        if (first) {
-            prev_pos = pos++;
-            first = false;
-            continue;
+        pos = findString(contentStart, contentEnd, seperator);
+        if (pos == contentEnd) {
+            pos = contentStart;
         }
-        std::string substring(content.substr(prev_pos, pos-prev_pos));
-        gameStringVector.push_back(substring);
-        prev_pos = pos++;
     }
 
-    gameStringVector.push_back(content.substr(prev_pos, pos-prev_pos)); // Last word
-    return !gameStringVector.empty();
+    nextGamePos = pos;
+    return true;
 }
 
 bool GameReader::nextGame(OpeningBoard& board) {
-    if (workingGameIdx >= gameStringVector.size()) {
+    if (nextGamePos >= contentEnd) {
         return false;
     }
 
-    auto gameString = gameStringVector.at(workingGameIdx);
+    // a game lasts to the next seperator
+    auto gameString = nextGamePos;
+    nextGamePos = findString(gameString + 1, contentEnd, seperator);
     workingGameIdx++;
 
-    auto theMap = parse(gameString);
+    // games are read once, those before this one are no longer kept in memory
+    if (mappedFile.getData()) {
+        mappedFile.release(gameString - mappedFile.getData());
+    }
+
+    std::vector<std::string> moveVec;
+    auto theMap = parse(gameString, nextGamePos - gameString, moveVec);
 
     const std::string fen = theMap["FEN"];
     const std::string result = theMap["Result"];
-    const std::string moves = theMap["moves"];
-    return parse(board, fen, moves, result);
+    return parse(board, fen, moveVec, result);
 }
 
-std::map<std::string, std::string> GameReader::parse(const std::string& gameString) const {
-    if (gameString.find("[Event", 0) != std::string::npos) {
-        return pgn_parse(gameString);
+std::map<std::string, std::string> GameReader::parse(const char* gameString, size_t len, std::vector<std::string>& moveVec) const {
+    if (findString(gameString, gameString + len, "[Event") != gameString + len) {
+        return pgn_parse(gameString, len, moveVec);
+    }
+
+    auto r = wxf_parse(gameString, len);
+
+    // words separated by spaces
+    std::istringstream moves(r["moves"]);
+    std::string s;
+    while (moves >> s) {
+        if (isalpha((unsigned char)s.at(0))) {
+            moveVec.push_back(s);
+        }
     }
-    return wxf_parse(gameString);
+    return r;
 }
 
-std::map<std::string, std::string> GameReader::pgn_parse(const std::string& gameString) const {
+// Tokenize a PGN game in one pass: tag pairs go to the map, move tokens to moveVec.
+// Comments {...}, ;... and nested variations (...) are skipped, check (+) and capture (x) signs are taken out.
+// Tokens which don't start with a letter (move numbers, results) are ignored
+std::map<std::string, std::string> GameReader::pgn_parse(const char* gameString, size_t len, std::vector<std::string>& moveVec) const {
     std::map<std::string, std::string> r;
 
-    // Headers
-    auto headerVec = splitString(gameString, "\\[[A-Za-z]+(\\s)+\"(.)+\"(\\s)*\\](\\s)*\n");
+    auto p = gameString, end = gameString + len;
+    int variationDepth = 0;
+    std::string token;
 
-    for (auto &&s : headerVec) {
-        if (s.length()<5 || s.at(0)!='[') {
-            continue;
+    while (true) {
+        char ch = p < end ? *p : ' ';
+
+        if (isspace((unsigned char)ch) || ch == '{' || ch == ';' || ch == '(' || ch == ')' || ch == '[') {
+            if (!token.empty()) {
+                if (variationDepth == 0 && isalpha((unsigned char)token.at(0))) {
+                    moveVec.push_back(token);
+                }
+                token.clear();
+            }
+        }
+
+        if (p >= end) {
+            break;
         }
 
-        auto qPos0 = s.find('"'); assert(qPos0 != std::string::npos);
-        auto qPos1 = s.find('"', qPos0 + 1); assert(qPos1 != std::string::npos);
+        switch (ch) {
+            case '{':
+                while (p < end && *p != '}') {
+                    p++;
+                }
+                break;
 
-        auto tag = s.substr(1, qPos0 - 2);
-        trim(tag);
+            case ';':
+                while (p < end && *p != '\n' && *p != '\r') {
+                    p++;
+                }
+                continue;
 
-        auto quote = s.substr(qPos0+1, qPos1 - qPos0 - 1);
-        r[tag] = quote;
-    }
+            case '(':
+                variationDepth++;
+                break;
 
-    // Body
-    if (!headerVec.empty()) {
-        // Takeout all comments
-        auto lastHeaderString = headerVec.back();
-        auto pos = gameString.find(lastHeaderString);
-        if (pos != std::string::npos) {
-            std::string body = gameString.substr(pos + lastHeaderString.length());
-            //std::cout << "body:==>" << body << "<==" << std::endl;
-
-            auto comVec = splitString(body, "(\\{(.|\r|\n)*?\\})|;.*");
-            for (auto &&com : comVec) {
-                removeSubstrs(body, com);
-            }
+            case ')':
+                if (variationDepth > 0) {
+                    variationDepth--;
+                }
+                break;
 
-            // trim out (())
-            while (true) {
-                auto start = body.find('(');
-                if (start == std::string::npos) {
-                    break;
+            case '[':
+            {
+                // [Tag "value"]
+                auto q = p + 1;
+                auto tagStart = q;
+                while (q < end && isalpha((unsigned char)*q)) {
+                    q++;
                 }
-                int open = 1;
-                bool trimmed = false;
-                for (auto p=start+1; p<body.length(); p++) {
-                    char ch = body.at(p);
-                    if (ch=='(') {
-                        open++;
-                        continue;
-                    }
-                    if (ch==')') {
-                        open--;
-                        if (open==0) {
-                            body = body.substr(0, start-1) + body.substr(p+1);
-                            trimmed = true;
-                            break;
-                        }
+                auto tagEnd = q;
+                while (q < end && (*q == ' ' || *q == '\t')) {
+                    q++;
+                }
+
+                const char* quote = nullptr;
+                if (tagEnd > tagStart && q < end && *q == '"') {
+                    quote = ++q;
+                    while (q < end && *q != '"' && *q != '\n') {
+                        q++;
                     }
                 }
 
-                if (!trimmed) {
-                    body = body.substr(0, start-1);
-                    break;
+                if (quote && q < end && *q == '"') {
+                    r[std::string(tagStart, tagEnd)] = std::string(quote, q);
                 }
+
+                // the rest of the line
+                while (q < end && *q != '\n') {
+                    q++;
+                }
+                p = q;
+                continue;
             }
 
-            std::string special = "+";
-            removeSubstrs(body, special);
-            special = "x";
-            removeSubstrs(body, special);
+            case '+':
+            case 'x':
+                break;
 
-            r["moves"] = body;
+            default:
+                if (!isspace((unsigned char)ch) && variationDepth == 0) {
+                    token.push_back(ch);
+                }
+                break;
         }
+        p++;
     }
 
-    if (!r.empty()) {
+    if (r.empty()) {
+        // not a game
+        moveVec.clear();
+    } else {
         r["type"] = "pgn";
     }
     return r;
 }
 
-bool GameReader::parse(OpeningBoard& board, const std::string& fen, const std::string& moves, const std::string& result) {
-    board.getHistList().clear();
-    board.setFen(fen);
+bool GameReader::parse(OpeningBoard& board, const std::string& fen, const std::vector<std::string>& moveVec, const std::string& result) {
+    board.newGame(fen);
     if (!board.isValid()) {
         return false;
     }
 
     board.setResult(result);
 
-    std::regex re("\\s+");
-    std::sregex_token_iterator first {moves.begin(), moves.end(), re, -1}, last;
-    std::vector<std::string> words = {first, last};
-
-    std::vector<std::string> moveVec;
-    for (auto &&s : words) {
-        if (!s.empty() && isalpha(s.at(0))) {
-            moveVec.push_back(s);
-
+    for (auto &&s : moveVec) {
+        if (!s.empty() && isalpha((unsigned char)s.at(0))) {
             int i = 0;
             char ch = s.at(i);
 
@@ -226,9 +267,9 @@ bool GameReader::parse(OpeningBoard& board, const std::string& fen, const std::s
             int left = (int)s.length() - i;
             if (left > 2) {
                 char ch = s.at(i);
-                if (isalpha(ch)) {
+                if (isalpha((unsigned char)ch)) {
                     fromCol = ch - 'a';
-                } else if (isdigit(ch)) {
+                } else if (isdigit((unsigned char)ch)) {
                     int r = ch - '0';
                     fromRow = 9 - r;
                 }
@@ -238,7 +279,7 @@ bool GameReader::parse(OpeningBoard& board, const std::string& fen, const std::s
             char colChr = s.at(i);
             char rowChr0 = s.at(i+1);
 
-            if (isalpha(colChr) && isdigit(rowChr0)) {
+            if (isalpha((unsigned char)colChr) && isdigit((unsigned char)rowChr0)) {
                 int col = colChr - 'a';
                 int row = rowChr0 - '0';
 
@@ -266,27 +307,14 @@ bool GameReader::parse(OpeningBoard& board, const std::string& fen, const std::s
 }
 
 opening::Move GameReader::findLegalMove(OpeningBoard& board, PieceType pieceType, int fromCol, int fromRow, int dest) {
-    MoveList moveList;
-    board.genLegal(moveList, board.side);
-
-    for (int i = 0; i < moveList.end; i++) {
-        auto move = moveList.list[i];
-        auto movePiece = board.getPiece(move.from);
-        if (movePiece.type == pieceType) {
-            if (((fromCol < 0 || (fromCol >= 0 && fromCol == move.from %  9))
-                 && (fromRow < 0 || (fromRow >= 0 && fromRow == move.from / 9))
-                 && (dest < 0 || (dest >= 0 && dest == move.dest)))) {
-                return move;
-            }
-        }
-    }
-
-    return Move(0, 0);
+    return board.findLegalMove(pieceType, fromCol, fromRow, dest);
 }
 
-std::map<std::string, std::string> GameReader::wxf_parse(const std::string& gameString) const {
+std::map<std::string, std::string> GameReader::wxf_parse(const char* str, size_t len) const {
     std::map<std::string, std::string> r;
 
+    std::string gameString(str, len);
+
     std::string::size_type pos0 = 0, pos1 = 0;
 
     std::vector<std::string> output;
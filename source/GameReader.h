@@ -23,8 +23,10 @@ namespace opening {
 
     class GameReader {
     public:
-        GameReader(const std::string& path);
-        bool init(const std::string& path);
+        // In memory mapping mode the file is not loaded but mapped, games are found
+        // one by one when being read, thus the memory is bounded by one game
+        GameReader(const std::string& path, bool mmapMode = false);
+        bool init(const std::string& path, bool mmapMode = false);
 
         static std::string loadFile(const std::string& fileName);
 
@@ -35,18 +37,28 @@ namespace opening {
         }
 
     private:
-        std::map<std::string, std::string> parse(const std::string& gameString) const;
-        std::map<std::string, std::string> pgn_parse(const std::string& gameString) const;
+        std::map<std::string, std::string> parse(const char* gameString, size_t len, std::vector<std::string>& moveVec) const;
+        std::map<std::string, std::string> pgn_parse(const char* gameString, size_t len, std::vector<std::string>& moveVec) const;
 
-        bool parse(OpeningBoard& board, const std::string& fen, const std::string& moves, const std::string& result);
+        bool parse(OpeningBoard& board, const std::string& fen, const std::vector<std::string>& moveVec, const std::string& result);
 
         opening::Move findLegalMove(OpeningBoard& board, PieceType pieceType, int fromCol, int fromRow, int dest);
 
-        std::map<std::string, std::string> wxf_parse(const std::string& gameString) const;
+        std::map<std::string, std::string> wxf_parse(const char* gameString, size_t len) const;
 //        bool wxf_parse(OpeningBoard& board, const std::string& fen, const std::string& moves);
 
+        static const char* findString(const char* from, const char* end, const char* str);
+
     private:
-        std::vector<std::string> gameStringVector;
+        GameReader(const GameReader&);
+        GameReader& operator = (const GameReader&);
+
+        MemMappedFile mappedFile;
+        std::string content; // whole file when it is not mapped
+
+        const char* contentEnd;
+        const char* nextGamePos;
+        const char* seperator;
         int workingGameIdx;
     };
 
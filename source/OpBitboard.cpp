@@ -0,0 +1,371 @@
+
+/*
+ This file is part of MoonRiver Xiangqi Opening Book, distributed under MIT license.
+
+ Copyright (c) 2018 Nguyen Hong Pham
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#include "OpBoard.h"
+#include "OpBitboard.h"
+
+#include <cstring>
+
+using namespace opening;
+
+SquareBits opening::squareBits[90];
+
+// Squares of a line (a rank or a file) reached from a square of it, one bit per square of the line
+class LineAttack {
+public:
+    u16 quiet;  // empty squares before the first pieces
+    u16 first;  // first pieces, rooks capture them
+    u16 second; // pieces behind the first ones (screens), cannons capture them
+};
+
+// Moves of pieces from every square of the board, computed once. Moves are blocked by occupied eyes
+// (elephants) and legs (horses), rook and cannon moves are given by occupancies of ranks and files
+static class BitboardTables {
+public:
+    BitboardTables() {
+        memset(this, 0, sizeof(*this));
+
+        static const int diagonalDirs[4][2] = { { -1, -1 }, { -1, 1 }, { 1, -1 }, { 1, 1 } };
+        static const int orthogonalDirs[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+
+        for(int pos = 0; pos < 90; pos++) {
+            int row = getRow(pos), col = getCol(pos);
+
+            auto& bits = squareBits[pos];
+            bits.bitboard.set(pos);
+            bits.rankBit = 1 << col;
+            bits.fileBit = 1 << row;
+            bits.row = row;
+            bits.col = col;
+
+            for(int i = 0; i < 4; i++) {
+                int dr = diagonalDirs[i][0], dc = diagonalDirs[i][1];
+                diagonals[pos][i] = isOnBoard(row + dr, col + dc) ? (row + dr) * 9 + col + dc : -1;
+
+                if (isElephantSquare(row, col) && isElephantSquare(row + 2 * dr, col + 2 * dc) && (row <= 4) == (row + 2 * dr <= 4)) {
+                    elephantMoves[pos][i].set((row + 2 * dr) * 9 + col + 2 * dc);
+                }
+                if (isAdvisorSquare(row, col) && isAdvisorSquare(row + dr, col + dc) && (row <= 2) == (row + dr <= 2)) {
+                    advisorMoves[pos].set((row + dr) * 9 + col + dc);
+                }
+
+                // horses attacking this square jump over its diagonal neighbour
+                setSquare(horseAttackers[pos][i], row + 2 * dr, col + dc);
+                setSquare(horseAttackers[pos][i], row + dr, col + 2 * dc);
+            }
+
+            for(int i = 0; i < 4; i++) {
+                int dr = orthogonalDirs[i][0], dc = orthogonalDirs[i][1];
+                orthogonals[pos][i] = isOnBoard(row + dr, col + dc) ? (row + dr) * 9 + col + dc : -1;
+
+                if (dr) {
+                    setSquare(horseMoves[pos][i], row + 2 * dr, col - 1);
+                    setSquare(horseMoves[pos][i], row + 2 * dr, col + 1);
+                } else {
+                    setSquare(horseMoves[pos][i], row - 1, col + 2 * dc);
+                    setSquare(horseMoves[pos][i], row + 1, col + 2 * dc);
+                }
+
+                if (isPalaceSquare(row, col) && isPalaceSquare(row + dr, col + dc) && (row <= 2) == (row + dr <= 2)) {
+                    kingMoves[pos].set((row + dr) * 9 + col + dc);
+                }
+            }
+
+            // black pawns go down, white ones go up, both go sideways after crossing the river
+            setSquare(pawnMoves[0][pos], row + 1, col);
+            setSquare(pawnMoves[1][pos], row - 1, col);
+            if (row >= 5) {
+                setSquare(pawnMoves[0][pos], row, col - 1);
+                setSquare(pawnMoves[0][pos], row, col + 1);
+            }
+            if (row <= 4) {
+                setSquare(pawnMoves[1][pos], row, col - 1);
+                setSquare(pawnMoves[1][pos], row, col + 1);
+            }
+        }
+
+        for(int sd = 0; sd < 2; sd++) {
+            for(int pos = 0; pos < 90; pos++) {
+                for(auto dests = pawnMoves[sd][pos]; !dests.isEmpty();) {
+                    pawnAttackers[sd][dests.popLowest()].set(pos);
+                }
+            }
+        }
+
+        for(int i = 0; i < 9; i++) {
+            for(int occ = 0; occ < (1 << 9); occ++) {
+                rankAttacks[i][occ] = lineAttack(i, occ, 9);
+            }
+        }
+        for(int i = 0; i < 10; i++) {
+            for(int occ = 0; occ < (1 << 10); occ++) {
+                fileAttacks[i][occ] = lineAttack(i, occ, 10);
+            }
+        }
+    }
+
+    Bitboard kingMoves[90], advisorMoves[90];
+    Bitboard elephantMoves[90][4], horseMoves[90][4], horseAttackers[90][4]; // by diagonals or orthogonals
+    Bitboard pawnMoves[2][90], pawnAttackers[2][90];
+    int8_t diagonals[90][4], orthogonals[90][4]; // neighbours, -1 for off board
+
+    LineAttack rankAttacks[9][1 << 9], fileAttacks[10][1 << 10];
+
+private:
+    static bool isOnBoard(int row, int col) {
+        return row >= 0 && row < 10 && col >= 0 && col < 9;
+    }
+    static bool isPalaceSquare(int row, int col) {
+        return col >= 3 && col <= 5 && ((row >= 0 && row <= 2) || (row >= 7 && row <= 9));
+    }
+    static bool isAdvisorSquare(int row, int col) {
+        return isPalaceSquare(row, col) && (col == 4) == (row == 1 || row == 8);
+    }
+    static bool isElephantSquare(int row, int col) {
+        return isOnBoard(row, col) && (((row == 0 || row == 4 || row == 5 || row == 9) && (col == 2 || col == 6))
+                                        || ((row == 2 || row == 7) && col % 4 == 0));
+    }
+    static void setSquare(Bitboard& bitboard, int row, int col) {
+        if (isOnBoard(row, col)) {
+            bitboard.set(row * 9 + col);
+        }
+    }
+
+    static LineAttack lineAttack(int idx, int occ, int len) {
+        LineAttack attack = { 0, 0, 0 };
+        for(int d = -1; d <= 1; d += 2) {
+            int cnt = 0;
+            for(int i = idx + d; i >= 0 && i < len && cnt < 2; i += d) {
+                if ((occ & (1 << i)) == 0) {
+                    if (cnt == 0) {
+                        attack.quiet |= 1 << i;
+                    }
+                    continue;
+                }
+                if (cnt++ == 0) {
+                    attack.first |= 1 << i;
+                } else {
+                    attack.second |= 1 << i;
+                }
+            }
+        }
+        return attack;
+    }
+} tables;
+
+static const Bitboard allSquares(~0ULL, (1ULL << (90 - 64)) - 1);
+
+///////////////////////////////////////////////////////////////////////
+
+void BitOccupancy::reset()
+{
+    memset(this, 0, sizeof(*this));
+}
+
+void BitOccupancy::setup(const PositionCore& core)
+{
+    reset();
+    for(int sd = 0; sd < 2; sd++) {
+        for(int i = 0; i < 16; i++) {
+            auto pos = core.pieceList[sd][i];
+            if (pos >= 0) {
+                toggle(pos, sd);
+            }
+        }
+    }
+}
+
+bool BitOccupancy::operator == (const BitOccupancy& o) const
+{
+    return memcmp(bySide, o.bySide, sizeof(bySide)) == 0
+        && memcmp(ranks, o.ranks, sizeof(ranks)) == 0
+        && memcmp(files, o.files, sizeof(files)) == 0;
+}
+
+void BitOccupancy::gen_addLineMoves(MoveList& moves, PieceType type, Side side, int from, bool captureOnly) const
+{
+    int row = getRow(from), col = getCol(from);
+    auto& rank = tables.rankAttacks[col][ranks[row]];
+    auto& file = tables.fileAttacks[row][files[col]];
+
+    auto& opponents = bySide[1 - static_cast<int>(side)];
+    auto rankBits = type == PieceType::rook ? rank.first : rank.second;
+    auto fileBits = type == PieceType::rook ? file.first : file.second;
+
+    // pieces reached are captured if they are opponent ones, quiet squares are empty
+    for(; rankBits; rankBits &= rankBits - 1) {
+        auto dest = row * 9 + Bitboard::lowestBit(rankBits);
+        if (opponents.test(dest)) {
+            moves.add(type, side, from, dest);
+        }
+    }
+    for(; fileBits; fileBits &= fileBits - 1) {
+        auto dest = Bitboard::lowestBit(fileBits) * 9 + col;
+        if (opponents.test(dest)) {
+            moves.add(type, side, from, dest);
+        }
+    }
+
+    if (captureOnly) {
+        return;
+    }
+    for(auto bits = rank.quiet; bits; bits &= bits - 1) {
+        moves.add(type, side, from, row * 9 + Bitboard::lowestBit(bits));
+    }
+    for(auto bits = file.quiet; bits; bits &= bits - 1) {
+        moves.add(type, side, from, Bitboard::lowestBit(bits) * 9 + col);
+    }
+}
+
+void BitOccupancy::gen(const PositionCore& core, MoveList& moves, Side side, PieceType type, bool captureOnly) const
+{
+    moves.reset();
+
+    int sd = static_cast<int>(side);
+    auto targets = captureOnly ? bySide[1 - sd] : allSquares.andNot(bySide[sd]);
+
+    int fromIdx = 0, toIdx = 16;
+    if (type != PieceType::empty) {
+        fromIdx = egtbPieceListStartIdxByType[static_cast<int>(type)];
+        toIdx = fromIdx + (type != PieceType::pawn ? 2 : 5);
+    }
+
+    for(int l = fromIdx; l < toIdx; l++) {
+        auto pos = core.pieceList[sd][l];
+        if (pos < 0) {
+            continue;
+        }
+
+        auto pieceType = egtbPieceListIdxToType[l];
+        Bitboard dests(0, 0);
+
+        switch (pieceType) {
+            case PieceType::king:
+                dests = tables.kingMoves[pos];
+                break;
+
+            case PieceType::advisor:
+                dests = tables.advisorMoves[pos];
+                break;
+
+            case PieceType::elephant:
+                for(int i = 0; i < 4; i++) {
+                    auto eye = tables.diagonals[pos][i];
+                    if (eye >= 0 && core.isEmpty(eye)) {
+                        dests |= tables.elephantMoves[pos][i];
+                    }
+                }
+                break;
+
+            case PieceType::horse:
+                for(int i = 0; i < 4; i++) {
+                    auto leg = tables.orthogonals[pos][i];
+                    if (leg >= 0 && core.isEmpty(leg)) {
+                        dests |= tables.horseMoves[pos][i];
+                    }
+                }
+                break;
+
+            case PieceType::pawn:
+                dests = tables.pawnMoves[sd][pos];
+                break;
+
+            case PieceType::rook:
+            case PieceType::cannon:
+                gen_addLineMoves(moves, pieceType, side, pos, captureOnly);
+                continue;
+
+            default:
+                continue;
+        }
+
+        for(dests = dests & targets; !dests.isEmpty();) {
+            moves.add(pieceType, side, pos, dests.popLowest());
+        }
+    }
+}
+
+bool BitOccupancy::isIncheck(const PositionCore& core, Side beingAttackedSide) const
+{
+    int kingPos = core.findKing(beingAttackedSide);
+    if (kingPos < 0) {
+        return false;
+    }
+
+    int row = getRow(kingPos), col = getCol(kingPos);
+    auto attackerSide = getXSide(beingAttackedSide);
+    auto rook = PositionCore::code(PieceType::rook, attackerSide);
+    auto cannon = PositionCore::code(PieceType::cannon, attackerSide);
+
+    // rook and cannon attacks are rays from the king, so is the facing king
+    auto& rank = tables.rankAttacks[col][ranks[row]];
+    for(auto bits = rank.first; bits; bits &= bits - 1) {
+        if (core.squares[row * 9 + Bitboard::lowestBit(bits)] == rook) {
+            return true;
+        }
+    }
+    for(auto bits = rank.second; bits; bits &= bits - 1) {
+        if (core.squares[row * 9 + Bitboard::lowestBit(bits)] == cannon) {
+            return true;
+        }
+    }
+
+    auto king = PositionCore::code(PieceType::king, attackerSide);
+    auto& file = tables.fileAttacks[row][files[col]];
+    for(auto bits = file.first; bits; bits &= bits - 1) {
+        auto piece = core.squares[Bitboard::lowestBit(bits) * 9 + col];
+        if (piece == rook || piece == king) {
+            return true;
+        }
+    }
+    for(auto bits = file.second; bits; bits &= bits - 1) {
+        if (core.squares[Bitboard::lowestBit(bits) * 9 + col] == cannon) {
+            return true;
+        }
+    }
+
+    int xsd = static_cast<int>(attackerSide);
+    auto pawn = PositionCore::code(PieceType::pawn, attackerSide);
+    for(auto froms = tables.pawnAttackers[xsd][kingPos] & bySide[xsd]; !froms.isEmpty();) {
+        if (core.squares[froms.popLowest()] == pawn) {
+            return true;
+        }
+    }
+
+    auto horse = PositionCore::code(PieceType::horse, attackerSide);
+    for(int i = 0; i < 4; i++) {
+        auto leg = tables.diagonals[kingPos][i];
+        if (leg < 0 || !core.isEmpty(leg)) {
+            continue;
+        }
+        for(auto froms = tables.horseAttackers[kingPos][i] & bySide[xsd]; !froms.isEmpty();) {
+            if (core.squares[froms.popLowest()] == horse) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
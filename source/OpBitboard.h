@@ -0,0 +1,169 @@
+
+/*
+ This file is part of MoonRiver Xiangqi Opening Book, distributed under MIT license.
+
+ Copyright (c) 2018 Nguyen Hong Pham
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#ifndef OpBitboard_hpp
+#define OpBitboard_hpp
+
+#include "Opening.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace opening {
+
+    class PositionCore;
+    class MoveList;
+
+    // Set of squares of the board, bits 0-63 in lo, 64-89 in hi
+    class Bitboard {
+    public:
+        u64 lo, hi;
+
+    public:
+        Bitboard() = default;
+        Bitboard(u64 _lo, u64 _hi) : lo(_lo), hi(_hi) {}
+
+        void reset() {
+            lo = hi = 0;
+        }
+
+        bool isEmpty() const {
+            return (lo | hi) == 0;
+        }
+
+        bool test(int pos) const {
+            return pos < 64 ? (lo >> pos) & 1 : (hi >> (pos - 64)) & 1;
+        }
+
+        void set(int pos) {
+            if (pos < 64) lo |= 1ULL << pos; else hi |= 1ULL << (pos - 64);
+        }
+
+        void toggle(int pos) {
+            if (pos < 64) lo ^= 1ULL << pos; else hi ^= 1ULL << (pos - 64);
+        }
+
+        Bitboard operator & (const Bitboard& b) const {
+            return Bitboard(lo & b.lo, hi & b.hi);
+        }
+        Bitboard operator | (const Bitboard& b) const {
+            return Bitboard(lo | b.lo, hi | b.hi);
+        }
+        Bitboard& operator |= (const Bitboard& b) {
+            lo |= b.lo; hi |= b.hi;
+            return *this;
+        }
+        Bitboard operator ^ (const Bitboard& b) const {
+            return Bitboard(lo ^ b.lo, hi ^ b.hi);
+        }
+        Bitboard& operator ^= (const Bitboard& b) {
+            lo ^= b.lo; hi ^= b.hi;
+            return *this;
+        }
+        Bitboard andNot(const Bitboard& b) const {
+            return Bitboard(lo & ~b.lo, hi & ~b.hi);
+        }
+
+        // Removes the lowest square from the set and returns it, the set must not be empty
+        int popLowest() {
+            if (lo) {
+                auto pos = lowestBit(lo);
+                lo &= lo - 1;
+                return pos;
+            }
+            auto pos = lowestBit(hi);
+            hi &= hi - 1;
+            return pos + 64;
+        }
+
+        static int lowestBit(u64 x) {
+#ifdef _MSC_VER
+            unsigned long idx;
+            _BitScanForward64(&idx, x);
+            return (int)idx;
+#else
+            return __builtin_ctzll(x);
+#endif
+        }
+    };
+
+    // Bits of a square in bitboards, ranks and files, thus pieces are moved without divisions and branches
+    class SquareBits {
+    public:
+        Bitboard bitboard;
+        u16 rankBit, fileBit;
+        u8 row, col;
+    };
+
+    extern SquareBits squareBits[90];
+
+    // Occupancy of a position: bitboards of sides, ranks and files with one bit per square (columns
+    // for ranks, rows for files). Rook and cannon moves are looked up by occupancies of ranks and files
+    class BitOccupancy {
+    public:
+        Bitboard bySide[2];
+        u16 ranks[10], files[9];
+
+    public:
+        void reset();
+        void setup(const PositionCore& core);
+
+        // a piece is put on an empty square or removed from its square
+        void toggle(int pos, int sd) {
+            auto& bits = squareBits[pos];
+            bySide[sd] ^= bits.bitboard;
+            ranks[bits.row] ^= bits.rankBit;
+            files[bits.col] ^= bits.fileBit;
+        }
+
+        // a piece of side sd moves to an empty square or captures a piece of side capSd (-1 for none).
+        // The destination of a capture stays occupied, thus only sides change there. Taking back is the same
+        void move(int from, int dest, int sd, int capSd) {
+            auto& fromBits = squareBits[from];
+            auto& destBits = squareBits[dest];
+            bySide[sd] ^= fromBits.bitboard ^ destBits.bitboard;
+            ranks[fromBits.row] ^= fromBits.rankBit;
+            files[fromBits.col] ^= fromBits.fileBit;
+            if (capSd >= 0) {
+                bySide[capSd] ^= destBits.bitboard;
+            } else {
+                ranks[destBits.row] ^= destBits.rankBit;
+                files[destBits.col] ^= destBits.fileBit;
+            }
+        }
+
+        bool operator == (const BitOccupancy& o) const;
+
+        void gen(const PositionCore& core, MoveList& moveList, Side side, PieceType type = PieceType::empty, bool capOnly = false) const;
+        bool isIncheck(const PositionCore& core, Side beingAttackedSide) const;
+
+    private:
+        void gen_addLineMoves(MoveList& moveList, PieceType type, Side side, int from, bool capOnly) const;
+    };
+
+} // namespace opening
+
+#endif /* OpBitboard_hpp */
@@ -88,10 +88,7 @@ std::string OpeningBoard::toString() const {
 }
 
 bool OpeningBoard::setup(const std::vector<Piece> pieceVec, Side _side) {
-    pieceList_reset((int8_t *)pieceList);
-    for (auto && p : pieces) {
-        p.setEmpty();
-    }
+    PositionCore::reset();
 
     side = _side;
     for (auto && p : pieceVec) {
@@ -114,7 +111,7 @@ void OpeningBoard::setResult(const std::string& resultString) {
 }
 
 void OpeningBoard::newGame(const std::string& fen) {
-    histList.clear();
+    undoList.clear();
     result.reset();
 
     setFen(fen);
@@ -123,17 +120,14 @@ void OpeningBoard::newGame(const std::string& fen) {
 
 void OpeningBoard::cloneFrom(const OpeningBoard& board) {
     newGame(board.startingFenString());
-    for(auto hist : board.histList) {
-        make(hist.move);
+    for(auto && undo : board.undoList) {
+        make(undo.move);
     }
     result = board.result;
 }
 
 void OpeningBoard::setFen(const std::string& fen_) {
-    pieceList_reset((int8_t *)pieceList);
-    for (auto && p : pieces) {
-        p.setEmpty();
-    }
+    PositionCore::reset();
 
     startingFen = fen_;
     std::string thefen = fen_;
@@ -198,15 +192,6 @@ void OpeningBoard::setFen(const std::string& fen_) {
     }
 
     initHashKey();
-
-    int idx[] = { 0, 0 };
-    for(int i = 0; i < 16; i++) {
-        for(int sd = 0; sd < 2; sd++) {
-            if (pieceList[sd][i] >= 0) {
-                pieces[pieceList[sd][i]].idx = idx[sd]++;
-            }
-        }
-    }
 }
 
 std::string OpeningBoard::getPgn() const {
@@ -214,7 +199,7 @@ std::string OpeningBoard::getPgn() const {
 }
 
 std::string OpeningBoard::getFen() const {
-    return getFen(side, histList.size(), histList.size() / 2 + 1);
+    return getFen(side, undoList.size(), undoList.size() / 2 + 1);
 }
 
 std::string OpeningBoard::getFen(Side side, int halfCount, int fullMoveCount) const {
@@ -272,7 +257,7 @@ bool OpeningBoard::isValid() const
     int pieceCout[2][7] = {{0,0,0,0,0,0,0}, {0,0,0,0,0,0,0}};
 
     for(int i = 0; i < 90; i++) {
-        auto p = pieces[i];
+        auto p = getPiece(i);
         if (p.isEmpty()) {
             continue;
         }
@@ -307,20 +292,6 @@ void OpeningBoard::pieceList_reset(int8_t *pieceList) {
     }
 }
 
-bool OpeningBoard::pieceList_set(int8_t *pieceList, int pos, PieceType type, Side side) {
-    int d = side == Side::white ? 16 : 0;
-    for (int t = egtbPieceListStartIdxByType[static_cast<int>(type)]; ; t++) {
-        if (t >= 16) {
-            break;
-        }
-        if (pieceList[d + t] < 0 || pieceList[d + t] == pos) {
-            pieceList[d + t] = pos;
-            return true;
-        }
-    }
-    return false;
-}
-
 bool OpeningBoard::pieceList_setEmpty(int8_t *pieceList, int pos, PieceType type, Side side) {
     int d = side == Side::white ? 16 : 0;
     for (int t = egtbPieceListStartIdxByType[static_cast<int>(type)]; ; t++) {
@@ -363,89 +334,12 @@ bool OpeningBoard::pieceList_isThereAttacker(const int8_t *pieceList) {
     return false;
 }
 
-bool OpeningBoard::pieceList_make(const Hist& hist) {
-    if (!hist.cap.isEmpty()) {
-        bool ok = false;
-        for (int t = egtbPieceListStartIdxByType[static_cast<int>(hist.cap.type)], sd = static_cast<int>(hist.cap.side); ; t++) {
-            if (t >= 16) {
-                break;
-            }
-            if (pieceList[sd][t] == hist.move.dest) {
-                pieceList[sd][t] = -1;
-                ok = true;
-                break;
-            }
-        }
-        if (!ok) {
-            return false;
-        }
-    }
-    for (int t = egtbPieceListStartIdxByType[static_cast<int>(hist.move.type)], sd = static_cast<int>(hist.move.side); ; t++) {
-        if (t >= 16) {
-            break;
-        }
-        if (pieceList[sd][t] == hist.move.from) {
-            pieceList[sd][t] = hist.move.dest;
-            return true;
-        }
-    }
-    return false;
-}
-
-bool OpeningBoard::pieceList_takeback(const Hist& hist) {
-    bool ok = false;
-    for (int t = egtbPieceListStartIdxByType[static_cast<int>(hist.move.type)], sd = static_cast<int>(hist.move.side); ; t++) {
-        if (t >= 16) {
-            break;
-        }
-        if (pieceList[sd][t] == hist.move.dest) {
-            pieceList[sd][t] = hist.move.from;
-            ok = true;
-            break;
-        }
-    }
-    if (!ok) {
-        return false;
-    }
-    if (hist.cap.isEmpty()) {
-        return true;
-    }
-    for (int t = egtbPieceListStartIdxByType[static_cast<int>(hist.cap.type)], sd = static_cast<int>(hist.cap.side); ; t++) {
-        if (t >= 16) {
-            break;
-        }
-        if (pieceList[sd][t] < 0) {
-            pieceList[sd][t] = hist.move.dest;
-            return true;
-        }
-    }
-    return false;
-}
-
 bool OpeningBoard::pieceList_setupBoard(const int8_t *thePieceList) {
-    reset();
+    int8_t list[32];
+    memcpy(list, thePieceList ? thePieceList : (const int8_t *)pieceList, sizeof(list));
 
-    if (thePieceList == nullptr) {
-        thePieceList = (const int8_t *) pieceList;
-    } else {
-        pieceList_reset((int8_t *)pieceList);
-    }
-
-    for (int sd = 0, d = 0; sd < 2; sd++, d = 16) {
-        Side side = static_cast<Side>(sd);
-        for(int i = 0; i < 16; i++) {
-            auto pos = thePieceList[d + i];
-            if (pos >= 0) {
-                if (!isEmpty(pos)) {
-                    return false;
-                }
-                auto type = egtbPieceListIdxToType[i];
-                set(pos, type, side);
-            }
-        }
-    }
-
-    return true;
+    reset();
+    return setPieceList(list, side);
 }
 
 static const int flip_h[90] = {
@@ -538,96 +432,335 @@ void OpeningBoard::flip(FlipMode flipMode) {
 }
 
 
-void OpeningBoard::xorHashKey(int pos) {
+// Zobrist keys of pieces as they are on flipped boards, indexed as hashTable by their current squares
+static class FlippedHashTables {
+public:
+    FlippedHashTables() {
+        static const FlipMode flipModes[] = { FlipMode::horizontal, FlipMode::vertical, FlipMode::rotate };
+        for(int m = 0; m < 3; m++) {
+            auto swapSide = flipModes[m] != FlipMode::horizontal;
+            for(int sd = 0; sd < 2; sd++) {
+                int flippedSd = swapSide ? 1 - sd : sd;
+                for(int type = 0; type < 7; type++) {
+                    for(int pos = 0; pos < 90; pos++) {
+                        table[m][sd * 7 * 90 + type * 90 + pos] = opening::hashTable[flippedSd * 7 * 90 + type * 90 + OpeningBoard::flip(pos, flipModes[m])];
+                    }
+                }
+            }
+        }
+    }
+
+    u64 table[3][2 * 7 * 90];
+} flippedHashTables;
+
+///////////////////////////////////////////////////////////////////////
+
+void PositionCore::reset()
+{
+    memset(squares, 0, sizeof(squares));
+    memset(pieceList, -1, sizeof(pieceList));
+    side = Side::white;
+    keys[0] = keys[1] = keys[2] = keys[3] = 0;
+#ifdef OPENING_BITBOARD_MOVEGEN
+    occupancy.reset();
+#endif
+}
+
+void PositionCore::xorKeys(int pos, int8_t code)
+{
+    assert(pos >= 0 && pos < 90 && code != 0);
+    int h = static_cast<int>(codeSide(code)) * 7 * 90 + static_cast<int>(codeType(code)) * 90 + pos;
+    keys[0] ^= hashTable[h];
+    for(int m = 0; m < 3; m++) {
+        keys[m + 1] ^= flippedHashTables.table[m][h];
+    }
+}
+
+// Pieces take only slots of their types, false if all are taken (too many pieces of that type)
+bool PositionCore::set(int pos, PieceType type, Side _side)
+{
     assert(pos >= 0 && pos < 90);
-    assert(!pieces[pos].isEmpty());
-    int sd = static_cast<int>(pieces[pos].side);
-    int p = static_cast<int>(pieces[pos].type);
-    int h = sd * 7 * 90 + p * 90 + pos;
-    hashKey ^= hashTable[h];
+    if (squares[pos]) {
+        setEmpty(pos);
+    }
+    if (type == PieceType::empty) {
+        return true;
+    }
+
+    auto sd = static_cast<int>(_side);
+    auto t = static_cast<int>(type);
+    auto endIdx = type == PieceType::pawn ? 16 : egtbPieceListStartIdxByType[t + 1];
+    for (int i = egtbPieceListStartIdxByType[t]; i < endIdx; i++) {
+        if (pieceList[sd][i] < 0) {
+            pieceList[sd][i] = pos;
+            squares[pos] = code(type, _side);
+            togglePiece(pos, squares[pos]);
+            return true;
+        }
+    }
+    return false;
 }
 
-void OpeningBoard::initHashKey() {
-    hashKey = 0;
-    for(int i = 0; i < 90; i++) {
-        if (!pieces[i].isEmpty()) {
-            xorHashKey(i);
+void PositionCore::setEmpty(int pos)
+{
+    auto c = squares[pos];
+    if (c == 0) {
+        return;
+    }
+
+    auto sd = static_cast<int>(codeSide(c));
+    for (int t = egtbPieceListStartIdxByType[static_cast<int>(codeType(c))]; t < 16; t++) {
+        if (pieceList[sd][t] == pos) {
+            pieceList[sd][t] = -1;
+            break;
         }
     }
+
+    togglePiece(pos, c);
+    squares[pos] = 0;
 }
 
-void OpeningBoard::make(const Move& move, Hist& hist) {
-    auto hk = hashKey; initHashKey();
-    assert(hk == hashKey);
-    assert(!pieces[move.from].isEmpty());
+// Same rules as OpeningBoard::setFen, the FEN is read in place
+bool PositionCore::setFen(const char* fen)
+{
+    reset();
 
-    hist.move = move;
-    hist.cap = pieces[move.dest];
-    hist.hashKey = hashKey;
+    if (fen == nullptr || *fen == 0) {
+        fen = originalFen.c_str();
+    }
 
-    xorHashKey(move.from);
-    if (!hist.cap.isEmpty()) {
-        xorHashKey(move.dest);
+    int pos = 0;
+    for(; *fen && *fen != ' '; fen++) {
+        char ch = *fen;
+        if (ch == '/') {
+            continue;
+        }
+        if (ch >= '0' && ch <= '9') {
+            pos += ch - '0';
+            continue;
+        }
+
+        auto pieceSide = Side::black;
+        if (ch >= 'A' && ch <= 'Z') {
+            pieceSide = Side::white;
+            ch += 'a' - 'A';
+        }
+
+        PieceType type;
+        switch (ch) {
+            case 'k': type = PieceType::king; break;
+            case 'a': type = PieceType::advisor; break;
+            case 'e': case 'b': type = PieceType::elephant; break;
+            case 'r': type = PieceType::rook; break;
+            case 'c': type = PieceType::cannon; break;
+            case 'h': case 'n': type = PieceType::horse; break;
+            case 'p': type = PieceType::pawn; break;
+            default:
+                return false;
+        }
+
+        if (pos >= 90 || squares[pos] || !set(pos, type, pieceSide)) {
+            return false;
+        }
+        pos++;
     }
 
-    pieces[move.dest] = pieces[move.from];
-    pieces[move.from].setEmpty();
+    // both kings are needed for generating and in-check detection
+    if (pieceList[0][0] < 0 || pieceList[1][0] < 0) {
+        return false;
+    }
 
-    xorHashKey(move.dest);
+    for(; *fen == ' '; fen++) {
+    }
+    if (*fen == 'b' || *fen == 'B') {
+        side = Side::black;
+    }
+    return true;
+}
 
-    pieceList_make(hist);
+// Pieces keep their indexes of the given list
+bool PositionCore::setPieceList(const int8_t* thePieceList, Side _side)
+{
+    reset();
+    side = _side;
 
-    auto hk1 = hashKey; initHashKey();
-    assert(hk1 == hashKey);
+    for (int sd = 0; sd < 2; sd++) {
+        for(int i = 0; i < 16; i++) {
+            auto pos = thePieceList[sd * 16 + i];
+            if (pos < 0) {
+                continue;
+            }
+            if (pos >= 90 || squares[pos]) {
+                return false;
+            }
+            pieceList[sd][i] = pos;
+            squares[pos] = code(egtbPieceListIdxToType[i], static_cast<Side>(sd));
+            togglePiece(pos, squares[pos]);
+        }
+    }
+    return pieceList[0][0] >= 0 && pieceList[1][0] >= 0;
+}
+
+void PositionCore::initHashKey()
+{
+    keys[0] = keys[1] = keys[2] = keys[3] = 0;
+    for(int i = 0; i < 90; i++) {
+        if (squares[i]) {
+            xorKeys(i, squares[i]);
+        }
+    }
 }
 
-void OpeningBoard::takeBack(const Hist& hist) {
-    hashKey = hist.hashKey;
-    pieces[hist.move.from] = pieces[hist.move.dest];
-    pieces[hist.move.dest] = hist.cap;
+// Hash key of the position (or of the flipped position) after making a given move, the board is not touched
+u64 PositionCore::keyAfterMove(const Move& move, FlipMode flipMode) const
+{
+    auto piece = squares[move.from];
+    assert(piece != 0);
 
-    pieceList_takeback(hist);
+    auto table = flipMode == FlipMode::none ? hashTable : flippedHashTables.table[static_cast<int>(flipMode) - 1];
+    int h = static_cast<int>(codeSide(piece)) * 7 * 90 + static_cast<int>(codeType(piece)) * 90;
+    auto key = keys[static_cast<int>(flipMode)] ^ table[h + move.from] ^ table[h + move.dest];
+
+    auto cap = squares[move.dest];
+    if (cap) {
+        key ^= table[static_cast<int>(codeSide(cap)) * 7 * 90 + static_cast<int>(codeType(cap)) * 90 + move.dest];
+    }
+    return key;
+}
+
+int8_t PositionCore::make(const Move& move)
+{
+    auto piece = squares[move.from];
+    auto cap = squares[move.dest];
+    assert(piece != 0);
+
+    if (cap) {
+        auto capSd = static_cast<int>(codeSide(cap));
+        for (int t = egtbPieceListStartIdxByType[static_cast<int>(codeType(cap))]; t < 16; t++) {
+            if (pieceList[capSd][t] == move.dest) {
+                pieceList[capSd][t] = -1;
+                break;
+            }
+        }
+    }
+
+    auto sd = static_cast<int>(codeSide(piece));
+    for (int t = egtbPieceListStartIdxByType[static_cast<int>(codeType(piece))]; t < 16; t++) {
+        if (pieceList[sd][t] == move.from) {
+            pieceList[sd][t] = move.dest;
+            break;
+        }
+    }
+
+    movePiece(move.from, move.dest, piece, cap);
+    squares[move.dest] = piece;
+    squares[move.from] = 0;
+    return cap;
+}
+
+void PositionCore::takeBack(const Move& move, int8_t cap)
+{
+    auto piece = squares[move.dest];
+    assert(piece != 0);
+
+    auto sd = static_cast<int>(codeSide(piece));
+    for (int t = egtbPieceListStartIdxByType[static_cast<int>(codeType(piece))]; t < 16; t++) {
+        if (pieceList[sd][t] == move.dest) {
+            pieceList[sd][t] = move.from;
+            break;
+        }
+    }
+
+    if (cap) {
+        auto capSd = static_cast<int>(codeSide(cap));
+        for (int t = egtbPieceListStartIdxByType[static_cast<int>(codeType(cap))]; t < 16; t++) {
+            if (pieceList[capSd][t] < 0) {
+                pieceList[capSd][t] = move.dest;
+                break;
+            }
+        }
+    }
+
+    // keys and bitboards are restored by the same toggles as making the move
+    movePiece(move.from, move.dest, piece, cap);
+    squares[move.from] = piece;
+    squares[move.dest] = cap;
 }
 
-void OpeningBoard::make(int from, int dest, bool createMoveStrings)
+void OpeningBoard::setup(const PositionCore& core)
+{
+    undoList.clear();
+    result.reset();
+    startingFen.clear();
+    static_cast<PositionCore&>(*this) = core;
+}
+
+void OpeningBoard::make(int from, int dest)
 {
     Move move(from, dest);
-    auto piece = pieces[from];
-    auto cap = pieces[dest];
+    auto piece = getPiece(from);
+    auto cap = getPiece(dest);
     move.type = piece.type;
     move.side = piece.side;
     move.capType = cap.type;
     move.score = 0;
 
-    make(move, createMoveStrings);
+    make(move);
 }
 
-void OpeningBoard::make(const Move& move, bool createMoveStrings)
+void OpeningBoard::make(const Move& move)
 {
-    Hist hist;
-
-    std::string moveString = "";
+    assert(!isEmpty(move.from));
 
-    if (createMoveStrings) {
-        collectExtraMoveInfo(move, hist);
+    // games are parsed and replayed many times, room for the undo records of most games is taken once
+    if (undoList.capacity() == 0) {
+        undoList.reserve(MaxPlyNumber);
     }
 
-    make(move, hist);
-
-    if (createMoveStrings) {
-        collectExtraMoveInfo_checkOrMate(hist);
-    }
-
-    histList.push_back(hist);
+    UndoRecord undo;
+    undo.move = move;
+    undo.cap = PositionCore::make(move);
+    undoList.push_back(undo);
     side = getXSide(side);
 }
 
 void OpeningBoard::takeBack()
 {
+    assert(!undoList.empty());
     side = getXSide(side);
-    auto hist = histList.back();
-    takeBack(hist);
-    histList.pop_back();
+    auto& undo = undoList.back();
+    PositionCore::takeBack(undo.move, undo.cap);
+    undoList.pop_back();
+}
+
+std::vector<Hist> OpeningBoard::getHistList(bool annotated) const
+{
+    // back to the starting position, then moves are made again
+    OpeningBoard board;
+    static_cast<PositionCore&>(board) = *this;
+    for(auto it = undoList.rbegin(); it != undoList.rend(); ++it) {
+        board.side = getXSide(board.side);
+        board.PositionCore::takeBack(it->move, it->cap);
+    }
+
+    std::vector<Hist> hists(undoList.size());
+    for(size_t i = 0; i < undoList.size(); i++) {
+        auto& undo = undoList[i];
+        auto& hist = hists[i];
+        hist.move = undo.move;
+        hist.cap.set(codeType(undo.cap), codeSide(undo.cap));
+        hist.hashKey = board.key();
+
+        if (annotated) {
+            board.collectExtraMoveInfo(undo.move, hist);
+        }
+        board.PositionCore::make(undo.move);
+        board.side = getXSide(board.side);
+        if (annotated) {
+            board.collectExtraMoveInfo_checkOrMate(hist);
+        }
+    }
+    return hists;
 }
 
 TheResult OpeningBoard::makeRule()
@@ -636,15 +769,10 @@ TheResult OpeningBoard::makeRule()
     MoveList moveList;
     gen(moveList, curSide);
 
+    CheckInfo checkInfo(*this, curSide);
     bool hasLegalMoves = false;
     for(int i = 0; i < moveList.end; i++) {
-        auto move = moveList.list[i];
-        Hist hist;
-        make(move, hist);
-        auto incheck = isIncheck(curSide);
-        takeBack(hist);
-
-        if (!incheck) {
+        if (checkInfo.isLegal(moveList.list[i])) {
             hasLegalMoves = true;
             break;
         }
@@ -653,18 +781,11 @@ TheResult OpeningBoard::makeRule()
     if (hasLegalMoves) {
     } else {
         result.result = curSide == Side::white ? ResultType::loss : ResultType::win;
-        result.reason = isIncheck(curSide)? ReasonType::mate : ReasonType::stalemate;
+        result.reason = checkInfo.isIncheck()? ReasonType::mate : ReasonType::stalemate;
     }
     return result;
 }
 
-int OpeningBoard::findKing(Side side) const
-{
-    auto sd = static_cast<int>(side);
-    auto kingpos = pieceList[sd][0];
-    return kingpos;
-}
-
 bool OpeningBoard::isLegalMove(int from, int dest)
 {
     MoveList moveList;
@@ -672,35 +793,222 @@ bool OpeningBoard::isLegalMove(int from, int dest)
     return moveList.end > 0;
 }
 
-void OpeningBoard::genLegal(MoveList& moves, Side side, int from, int dest) {
-
+void PositionCore::genLegal(MoveList& moves, Side side, int from, int dest) const
+{
     MoveList moveList;
     gen(moveList, side);
 
-    Hist hist;
+    moves.reset();
+    CheckInfo checkInfo(*this, side);
+
     for (int i = 0; i < moveList.end; i++) {
         auto move = moveList.list[i];
         if ((from >= 0 && move.from != from) || (dest >= 0 && move.dest != dest)) {
             continue;
         }
 
-        make(move, hist);
-        if (!isIncheck(side)) {
+        if (checkInfo.isLegal(move)) {
             moves.add(move);
         }
-        takeBack(hist);
     }
 }
 
-void OpeningBoard::gen_addMove(MoveList& moves, int from, int dest, bool captureOnly) const {
-    auto toSide = pieces[dest].side;
+CheckInfo::CheckInfo(const PositionCore& _core, Side side)
+    : core(_core), kingPos(_core.findKing(side)), incheck(false), pinned(0, 0), screenSquares(0, 0)
+{
+    if (kingPos < 0) {
+        return;
+    }
+    incheck = core.isIncheck(side);
+    if (incheck) {
+        return;
+    }
+
+    auto attackerSide = getXSide(side);
+    auto rook = PositionCore::code(PieceType::rook, attackerSide), cannon = PositionCore::code(PieceType::cannon, attackerSide);
+    auto king = PositionCore::code(PieceType::king, attackerSide), horse = PositionCore::code(PieceType::horse, attackerSide);
+
+    static const int lineDirs[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+    static const int diagonalDirs[4][2] = { { -1, -1 }, { -1, 1 }, { 1, -1 }, { 1, 1 } };
+
+    int kingRow = getRow(kingPos), kingCol = getCol(kingPos);
+
+    // the first three pieces of each line of the king
+    for(int d = 0; d < 4; d++) {
+        int dr = lineDirs[d][0], dc = lineDirs[d][1];
+        int pieces[3], cnt = 0;
+        for(int r = kingRow + dr, c = kingCol + dc; r >= 0 && r < 10 && c >= 0 && c < 9 && cnt < 3; r += dr, c += dc) {
+            if (!core.isEmpty(r * 9 + c)) {
+                pieces[cnt++] = r * 9 + c;
+            }
+        }
+        if (cnt == 0) {
+            continue;
+        }
 
-    if (pieces[from].side != toSide && (!captureOnly || toSide != Side::none)) {
-        moves.add(pieces[from].type, pieces[from].side, from, dest);
+        auto first = core.squares[pieces[0]];
+        auto second = cnt > 1 ? core.squares[pieces[1]] : 0;
+        auto third = cnt > 2 ? core.squares[pieces[2]] : 0;
+
+        // pinned by a rook or the facing king, or one of two screens of a cannon
+        if (PositionCore::codeSide(first) == side && (second == rook || (second == king && dc == 0) || third == cannon)) {
+            pinned.set(pieces[0]);
+        }
+        if (cnt > 1 && PositionCore::codeSide(second) == side && third == cannon) {
+            pinned.set(pieces[1]);
+        }
+
+        // a piece put between the king and a cannon becomes its screen
+        if (first == cannon) {
+            for(int pos = kingPos + dr * 9 + dc; pos != pieces[0]; pos += dr * 9 + dc) {
+                screenSquares.set(pos);
+            }
+        }
     }
+
+    // pieces on horse legs next to the king
+    for(int d = 0; d < 4; d++) {
+        int dr = diagonalDirs[d][0], dc = diagonalDirs[d][1];
+        int r = kingRow + dr, c = kingCol + dc;
+        if (r < 0 || r >= 10 || c < 0 || c >= 9 || core.getSide(r * 9 + c) != side) {
+            continue;
+        }
+        if ((r + dr >= 0 && r + dr < 10 && core.squares[(r + dr) * 9 + c] == horse)
+            || (c + dc >= 0 && c + dc < 9 && core.squares[r * 9 + c + dc] == horse)) {
+            pinned.set(r * 9 + c);
+        }
+    }
+}
+
+// Same tests as isIncheckBySquares, on the board as it would be after the move
+bool PositionCore::isIncheckAfterMove(const Move& move) const
+{
+    auto piece = squares[move.from];
+    assert(piece != 0);
+
+    auto side = codeSide(piece), attackerSide = getXSide(side);
+    int kingPos = codeType(piece) == PieceType::king ? move.dest : findKing(side);
+    if (kingPos < 0) {
+        return false;
+    }
+
+    auto pieceAt = [&](int pos) -> int8_t {
+        return pos == move.dest ? piece : (pos == move.from ? 0 : squares[pos]);
+    };
+
+    auto rook = code(PieceType::rook, attackerSide), cannon = code(PieceType::cannon, attackerSide);
+    auto king = code(PieceType::king, attackerSide), pawn = code(PieceType::pawn, attackerSide);
+    auto horse = code(PieceType::horse, attackerSide);
+
+    static const int lineDirs[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+    static const int diagonalDirs[4][2] = { { -1, -1 }, { -1, 1 }, { 1, -1 }, { 1, 1 } };
+
+    int kingRow = getRow(kingPos), kingCol = getCol(kingPos);
+
+    for(int d = 0; d < 4; d++) {
+        int dr = lineDirs[d][0], dc = lineDirs[d][1];
+        int cnt = 0;
+        for(int r = kingRow + dr, c = kingCol + dc; r >= 0 && r < 10 && c >= 0 && c < 9; r += dr, c += dc) {
+            auto p = pieceAt(r * 9 + c);
+            if (p == 0) {
+                continue;
+            }
+            if (++cnt == 2) {
+                if (p == cannon) {
+                    return true;
+                }
+                break;
+            }
+
+            // pawns attack sideways after crossing the river, black ones down, white ones up
+            if (p == rook || (p == king && dc == 0)) {
+                return true;
+            }
+            if (p == pawn && abs(r - kingRow) + abs(c - kingCol) == 1) {
+                if (dr == 0 ? (attackerSide == Side::black ? r >= 5 : r <= 4) : (attackerSide == Side::black) == (dr < 0)) {
+                    return true;
+                }
+            }
+        }
+    }
+
+    // horses jump over the legs next to the king
+    for(int d = 0; d < 4; d++) {
+        int dr = diagonalDirs[d][0], dc = diagonalDirs[d][1];
+        int r = kingRow + dr, c = kingCol + dc;
+        if (r < 0 || r >= 10 || c < 0 || c >= 9 || pieceAt(r * 9 + c)) {
+            continue;
+        }
+        if ((r + dr >= 0 && r + dr < 10 && pieceAt((r + dr) * 9 + c) == horse)
+            || (c + dc >= 0 && c + dc < 9 && pieceAt(r * 9 + c + dc) == horse)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void PositionCore::gen_addMove(MoveList& moves, int from, int dest, bool captureOnly) const {
+    auto toSide = getSide(dest);
+    auto piece = squares[from];
+
+    if (codeSide(piece) != toSide && (!captureOnly || toSide != Side::none)) {
+        moves.add(codeType(piece), codeSide(piece), from, dest);
+    }
+}
+
+void PositionCore::gen(MoveList& moves, Side side, PieceType type, bool captureOnly) const
+{
+#ifdef OPENING_BITBOARD_MOVEGEN
+    occupancy.gen(*this, moves, side, type, captureOnly);
+#else
+    genBySquares(moves, side, type, captureOnly);
+#endif
 }
 
-void OpeningBoard::gen(MoveList& moves, Side side, PieceType type, bool captureOnly) const {
+// Walking from the king is faster than the bitboard test (BitOccupancy::isIncheck), rays from
+// the palace are short and stop at their second pieces. Both builds use it
+bool PositionCore::isIncheck(Side beingAttackedSide) const
+{
+    return isIncheckBySquares(beingAttackedSide);
+}
+
+bool PositionCore::crossCheckGen(Side side) const
+{
+    BitOccupancy bitOccupancy;
+    bitOccupancy.setup(*this);
+#ifdef OPENING_BITBOARD_MOVEGEN
+    if (!(bitOccupancy == occupancy)) {
+        return false;
+    }
+#endif
+
+    auto lessThan = [](const Move& a, const Move& b) {
+        return a.from < b.from || (a.from == b.from && a.dest < b.dest);
+    };
+
+    for(int captureOnly = 0; captureOnly < 2; captureOnly++) {
+        MoveList moves0, moves1;
+        genBySquares(moves0, side, PieceType::empty, captureOnly != 0);
+        bitOccupancy.gen(*this, moves1, side, PieceType::empty, captureOnly != 0);
+        if (moves0.end != moves1.end) {
+            return false;
+        }
+
+        std::sort(moves0.list, moves0.list + moves0.end, lessThan);
+        std::sort(moves1.list, moves1.list + moves1.end, lessThan);
+        for(int i = 0; i < moves0.end; i++) {
+            if (moves0.list[i] != moves1.list[i] || moves0.list[i].type != moves1.list[i].type) {
+                return false;
+            }
+        }
+    }
+
+    return isIncheckBySquares(Side::black) == bitOccupancy.isIncheck(*this, Side::black)
+        && isIncheckBySquares(Side::white) == bitOccupancy.isIncheck(*this, Side::white);
+}
+
+void PositionCore::genBySquares(MoveList& moves, Side side, PieceType type, bool captureOnly) const {
     moves.reset();
 
     int sd = static_cast<int>(side);
@@ -716,7 +1024,7 @@ void OpeningBoard::gen(MoveList& moves, Side side, PieceType type, bool captureO
         if (pos < 0) {
             continue;
         }
-        auto piece = pieces[pos];
+        auto piece = getPiece(pos);
 
         switch (piece.type) {
             case PieceType::king:
@@ -966,7 +1274,7 @@ void OpeningBoard::gen(MoveList& moves, Side side, PieceType type, bool captureO
     }
 }
 
-bool OpeningBoard::isIncheck(Side beingAttackedSide) const
+bool PositionCore::isIncheckBySquares(Side beingAttackedSide) const
 {
     int kingPos = findKing(beingAttackedSide);
 
@@ -981,7 +1289,7 @@ bool OpeningBoard::isIncheck(Side beingAttackedSide) const
     int y = kingPos + 9;
     if (y < 90) {
         int f = 0;
-        auto p = pieces[y];
+        auto p = getPiece(y);
         if (!p.isEmpty()) {
             f = 1;
             if (p.side == attackerSide && (p.type == PieceType::rook || (p.type == PieceType::pawn && attackerSide == Side::white))) {
@@ -990,7 +1298,7 @@ bool OpeningBoard::isIncheck(Side beingAttackedSide) const
         }
 
         for (int yy = y+9; yy < 90; yy+=9) {
-            auto p = pieces[yy];
+            auto p = getPiece(yy);
             if (p.isEmpty()) {
                 continue;
             }
@@ -1010,7 +1318,7 @@ bool OpeningBoard::isIncheck(Side beingAttackedSide) const
     y = kingPos - 1;
     int f = 0;
 
-    auto p = pieces[y];
+    auto p = getPiece(y);
     if (!p.isEmpty()) {
         f = 1;
         if (p.side == attackerSide && (p.type == PieceType::rook || p.type == PieceType::pawn)) {
@@ -1021,7 +1329,7 @@ bool OpeningBoard::isIncheck(Side beingAttackedSide) const
     int col = kingPos % 9;
 
     for (int yy = y-1; yy >= kingPos - col; yy--) {
-        auto p = pieces[yy];
+        auto p = getPiece(yy);
         if (p.isEmpty()) {
             continue;
         }
@@ -1039,7 +1347,7 @@ bool OpeningBoard::isIncheck(Side beingAttackedSide) const
     /* go right */
     y = kingPos + 1;
     f = 0;
-    p = pieces[y];
+    p = getPiece(y);
     if (!p.isEmpty()) {
         f = 1;
         if (p.side == attackerSide && (p.type == PieceType::rook || p.type == PieceType::pawn)) {
@@ -1048,7 +1356,7 @@ bool OpeningBoard::isIncheck(Side beingAttackedSide) const
     }
 
     for (int yy = y+1; yy < kingPos - col + 9; yy++) {
-        auto p = pieces[yy];
+        auto p = getPiece(yy);
         if (p.isEmpty()) {
             continue;
         }
@@ -1067,7 +1375,7 @@ bool OpeningBoard::isIncheck(Side beingAttackedSide) const
     y = kingPos - 9;
     if (y >= 0) {
         f = 0;
-        p = pieces[y];
+        p = getPiece(y);
         if (!p.isEmpty()) {
             f = 1;
             if (p.side == attackerSide && (p.type == PieceType::rook || (p.type == PieceType::pawn && attackerSide == Side::black))) {
@@ -1076,7 +1384,7 @@ bool OpeningBoard::isIncheck(Side beingAttackedSide) const
         }
 
         for (int yy = y-9; yy >= 0; yy-=9) {
-            auto p = pieces[yy];
+            auto p = getPiece(yy);
             if (p.isEmpty()) {
                 continue;
             }
@@ -1374,9 +1682,9 @@ Move OpeningBoard::moveFromString_san(const std::string& s)
     int left = (int)s.length() - i;
     if (left > 2) {
         char ch = s.at(i);
-        if (isalpha(ch)) {
+        if (isalpha((unsigned char)ch)) {
             fromCol = ch - 'a';
-        } else if (isdigit(ch)) {
+        } else if (isdigit((unsigned char)ch)) {
             int r = ch - '0';
             fromRow = 9 - r;
         }
@@ -1386,7 +1694,7 @@ Move OpeningBoard::moveFromString_san(const std::string& s)
     char colChr = s.at(i);
     char rowChr0 = s.at(i+1);
 
-    if (isalpha(colChr) && isdigit(rowChr0)) {
+    if (isalpha((unsigned char)colChr) && isdigit((unsigned char)rowChr0)) {
         int col = colChr - 'a';
         int row = rowChr0 - '0';
 
@@ -1403,30 +1711,36 @@ Move OpeningBoard::moveFromString_san(const std::string& s)
     return noMove;
 }
 
+// Resolve a move from its piece type, destination and disambiguation. Only moves of that piece type
+// are generated, candidates are tested on the board as it would be after them. A pawn without its
+// file is the one pushed along the destination file, any other ambiguity is rejected
 Move OpeningBoard::findLegalMove(PieceType pieceType, int fromCol, int fromRow, int dest) {
     MoveList moveList;
-    gen(moveList, side);
+    gen(moveList, side, pieceType);
 
+    MoveList candidates;
     for (int i = 0; i < moveList.end; i++) {
         auto move = moveList.list[i];
-        auto movePiece = getPiece(move.from);
-        if (movePiece.type == pieceType) {
-            if (((fromCol < 0 || (fromCol >= 0 && fromCol == move.from %  9))
-                 && (fromRow < 0 || (fromRow >= 0 && fromRow == move.from / 9))
-                 && (dest < 0 || (dest >= 0 && dest == move.dest)))) {
-                Hist hist;
-                make(move, hist);
-                auto ok = !isIncheck(side);
-                takeBack(hist);
-                if (ok) {
-                    return move;
-                }
-                break;
+        if (move.type == pieceType
+            && (fromCol < 0 || fromCol == move.from % 9)
+            && (fromRow < 0 || fromRow == move.from / 9)
+            && (dest < 0 || dest == move.dest)
+            && !isIncheckAfterMove(move)) {
+            candidates.add(move);
+        }
+    }
+
+    if (candidates.end > 1 && pieceType == PieceType::pawn && fromCol < 0) {
+        MoveList pushes;
+        for (int i = 0; i < candidates.end; i++) {
+            if (candidates.list[i].from % 9 == candidates.list[i].dest % 9) {
+                pushes.add(candidates.list[i]);
             }
         }
+        candidates = pushes;
     }
 
-    return Move(0, 0);
+    return candidates.end == 1 ? candidates.list[0] : Move(0, 0);
 }
 
 void OpeningBoard::collectExtraMoveInfo_checkOrMate(Hist& hist)
@@ -1454,12 +1768,7 @@ void OpeningBoard::collectExtraMoveInfo(const Move& makingmove, Hist& hist)
                 if (move2.from == makingmove.from || move2.dest != makingmove.dest)
                     continue;
 
-                Hist tmpHist;
-                make(move2, tmpHist);
-                bool legal = !isIncheck(side);
-                takeBack(tmpHist);
-
-                if (!legal) {
+                if (isIncheckAfterMove(move2)) {
                     continue;
                 }
 
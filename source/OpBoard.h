@@ -29,6 +29,7 @@
 
 #include <vector>
 #include "Opening.h"
+#include "OpBitboard.h"
 
 namespace opening {
 
@@ -155,6 +156,7 @@ namespace opening {
         }
     };
 
+    // Move of a game with its notes, produced on request (see OpeningBoard::getHistList)
     class Hist {
     public:
         Move move;
@@ -184,10 +186,17 @@ namespace opening {
 
     };
 
+    // Record to take a move back, a few bytes without any heap data
+    class UndoRecord {
+    public:
+        Move move;
+        int8_t cap; // code of the captured piece (see PositionCore)
+    };
+
     class MoveList {
+    public:
         const static int MaxMoveNumber = 400;
 
-    public:
         Move list[MaxMoveNumber];
         int end;
 
@@ -256,59 +265,162 @@ namespace opening {
         }
     };
 
-    class OpeningBoard {
-    private:
-        Piece pieces[90];
-        TheResult result;
-
+    // Compact position: one byte per square, piece lists and keys of the position in all flip modes.
+    // It is trivially copyable (160 bytes, 232 with bitboards) and it is all that generating, making and probing need.
+    // It is set up straight from a FEN buffer or a piece list without touching the heap
+    class PositionCore {
     public:
-        int8_t pieceList[2][16];
+        u64 keys[4];
+        int8_t squares[90]; // 0: empty, otherwise type + 1 in low 3 bits and the side above
+        int8_t pieceList[2][16]; // squares of pieces or -1, types are given by indexes (egtbPieceListIdxToType)
         Side side;
+#ifdef OPENING_BITBOARD_MOVEGEN
+        BitOccupancy occupancy; // follows squares
+#endif
 
     public:
-        void newGame(const std::string& fen);
-
-        void set(int pos, PieceType type, Side side) {
-            pieces[pos].set(type, side);
-            pieceList_set((int8_t *)pieceList, pos, type, side);
+        static int8_t code(PieceType type, Side side) {
+            return type == PieceType::empty ? 0 : static_cast<int8_t>((static_cast<int>(side) << 3) | (static_cast<int>(type) + 1));
         }
+        static PieceType codeType(int8_t code) {
+            return code ? static_cast<PieceType>((code & 7) - 1) : PieceType::empty;
+        }
+        static Side codeSide(int8_t code) {
+            return code ? static_cast<Side>(code >> 3) : Side::none;
+        }
+
+        void reset();
+        bool set(int pos, PieceType type, Side side);
+        void setEmpty(int pos);
+
+        bool setFen(const char* fen);
+        bool setPieceList(const int8_t* pieceList, Side side);
 
         Piece getPiece(int pos) const {
-            return pieces[pos];
+            return Piece(codeType(squares[pos]), codeSide(squares[pos]));
         }
 
         Side getSide(int pos) const {
-            return pieces[pos].side;
+            return codeSide(squares[pos]);
         }
 
-        TheResult getResult() const {
-            return result;
+        bool isEmpty(int pos) const {
+            return squares[pos] == 0;
         }
 
-//        std::string getResultString() const;
-//
-//        Reason getReason() const {
-//            return reason;
-//        }
-
-        bool isEmpty(int pos) const {
-            return pieces[pos].type == PieceType::empty;
+        bool isPiece(int pos, PieceType type, Side side) const {
+            return squares[pos] == code(type, side);
         }
 
-        void setEmpty(int pos) {
-            pieces[pos].setEmpty();
+        // Keys of the position as it is flipped are updated with the main key thus the board
+        // doesn't need to be flipped for lookups. Colours are swapped by vertical flips and rotations
+        u64 key(FlipMode flipMode = FlipMode::none) const {
+            return keys[static_cast<int>(flipMode)];
         }
+        u64 keyAfterMove(const Move& move, FlipMode flipMode = FlipMode::none) const;
+        void initHashKey();
 
-        void genLegal(MoveList& moves, Side side, int from = -1, int dest = -1);
+        // Generators walk squares, or use bitboards (OpBitboard.h) when OPENING_BITBOARD_MOVEGEN is defined.
+        // Bitboards generate about twice as fast but cost more to keep when making moves, thus code which makes
+        // every generated move (perft by making) is not faster with them. In-check tests walk squares in both builds
         void gen(MoveList& moveList, Side side, PieceType type = PieceType::empty, bool capOnly = false) const;
-
         bool isIncheck(Side beingAttackedSide) const;
 
-        void make(const Move& move, Hist& hist);
-        void takeBack(const Hist& hist);
+        void genBySquares(MoveList& moveList, Side side, PieceType type = PieceType::empty, bool capOnly = false) const;
+        bool isIncheckBySquares(Side beingAttackedSide) const;
 
-        void make(int from, int dest, bool createMoveStrings = false);
-        void make(const Move& move, bool createMoveStrings = false);
+        // Both generators give the same moves (in their own orders) and find the same checks.
+        // It is too slow for every generation, the perft suite runs it on its trees
+        bool crossCheckGen(Side side) const;
+
+        // Legal moves only (of a piece or to a square when given), found without making moves (see CheckInfo)
+        void genLegal(MoveList& moveList, Side side, int from = -1, int dest = -1) const;
+
+        // The king of the moving side is attacked after the move, the board is not touched
+        bool isIncheckAfterMove(const Move& move) const;
+
+        // The side to move is not changed. Returns the code of the captured piece for taking back
+        int8_t make(const Move& move);
+        void takeBack(const Move& move, int8_t cap);
+
+        int findKing(Side side) const {
+            return pieceList[static_cast<int>(side)][0];
+        }
+
+    private:
+        void gen_addMove(MoveList& moveList, int from, int dest, bool capOnly) const;
+        void xorKeys(int pos, int8_t code);
+
+        // a piece is put on or removed from a square, keys and bitboards are updated
+        void togglePiece(int pos, int8_t code) {
+            xorKeys(pos, code);
+#ifdef OPENING_BITBOARD_MOVEGEN
+            occupancy.toggle(pos, static_cast<int>(codeSide(code)));
+#endif
+        }
+
+        // a piece moves from a square to another, capturing (cap is not 0) or not. Making and taking back are the same
+        void movePiece(int from, int dest, int8_t piece, int8_t cap) {
+            xorKeys(from, piece);
+            xorKeys(dest, piece);
+            if (cap) {
+                xorKeys(dest, cap);
+            }
+#ifdef OPENING_BITBOARD_MOVEGEN
+            occupancy.move(from, dest, static_cast<int>(codeSide(piece)), cap ? static_cast<int>(codeSide(cap)) : -1);
+#endif
+        }
+    };
+
+    // Tells which pseudo-legal moves of a side are legal without making them. Pinned pieces (by rooks,
+    // the facing king, as cannon screens or on legs of checking horses) and squares which would become
+    // cannon screens are found once, other moves are legal unless the king is in check. Moves of the king,
+    // of pinned pieces, to screen squares and all moves when in check are tested by isIncheckAfterMove
+    class CheckInfo {
+    public:
+        CheckInfo(const PositionCore& core, Side side);
+
+        bool isLegal(const Move& move) const {
+            if (move.from == kingPos || incheck || pinned.test(move.from) || screenSquares.test(move.dest)) {
+                return !core.isIncheckAfterMove(move);
+            }
+            return true;
+        }
+
+        bool isIncheck() const {
+            return incheck;
+        }
+
+    private:
+        const PositionCore& core;
+        int kingPos;
+        bool incheck;
+        Bitboard pinned, screenSquares;
+    };
+
+    // Game record around a position: history of moves with their notes, result and starting FEN
+    class OpeningBoard : public PositionCore {
+    private:
+        TheResult result;
+
+    public:
+        const static int MaxPlyNumber = 512;
+
+        void newGame(const std::string& fen);
+
+        TheResult getResult() const {
+            return result;
+        }
+
+//        std::string getResultString() const;
+//
+//        Reason getReason() const {
+//            return reason;
+//        }
+
+        // Moves of the game are kept as undo records only, notes of moves are made by getHistList
+        void make(int from, int dest);
+        void make(const Move& move);
         void takeBack();
 
         TheResult makeRule();
@@ -322,6 +434,9 @@ namespace opening {
 
         bool setup(const std::vector<Piece> pieceVec, Side side);
 
+        // The board doesn't keep any FEN then
+        void setup(const PositionCore& core);
+
         void cloneFrom(const OpeningBoard& board);
 
         void show(const char* msg = nullptr) const;
@@ -330,11 +445,12 @@ namespace opening {
         std::string getFen() const;
         std::string getFen(Side side, int halfCount = 0, int fullMoveCount = 0) const;
 
+        // pieces are removed, the side to move is kept
         void reset() {
-            for (int i = 0; i < 90; i++) {
-                setEmpty(i);
-            }
-            histList.clear();
+            auto sd = side;
+            PositionCore::reset();
+            side = sd;
+            undoList.clear();
             result.result = ResultType::noresult;
         }
 
@@ -351,17 +467,15 @@ namespace opening {
 
         bool isValid() const;
 
-        u64 key() const {
-            return hashKey;
+        int getPly() const {
+            return (int)undoList.size();
         }
-
-        std::vector<Hist>& getHistList() {
-            return histList;
+        const std::vector<UndoRecord>& getUndoList() const {
+            return undoList;
         }
-        const std::vector<Hist>& getHistList() const {
-            return histList;
-        }
-        void initHashKey();
+
+        // Moves of the game with their keys and captured pieces, also SAN notes and check marks when annotated
+        std::vector<Hist> getHistList(bool annotated = false) const;
 
         bool isLegalMove(const Move& move) {
             return isLegalMove(move.from, move.dest);
@@ -373,6 +487,7 @@ namespace opening {
         Move moveFromSanString(std::string str);
 
         Move moveFromString_san(const std::string& s);
+        Move findLegalMove(PieceType pieceType, int fromCol, int fromRow, int dest);
         static Move moveFromString_algebraicCoordinates(const std::string& s);
 
         void collectExtraMoveInfo(const Move& makingmove, Hist& hist);
@@ -381,34 +496,17 @@ namespace opening {
         static std::string squareString(int pos);
 
     private:
-        Move findLegalMove(PieceType pieceType, int fromCol, int fromRow, int dest);
-
         std::string toString() const;
 
-        void gen_addMove(MoveList& moveList, int from, int dest, bool capOnly) const;
-        int findKing(Side side) const;
-
-        bool isPiece(int pos, PieceType type, Side side) const {
-            auto p = pieces[pos];
-            return p.type==type && p.side==side;
-        }
-
         static bool pieceList_set(int8_t *pieceList, int pos, PieceType type, Side side);
         static bool pieceList_setEmpty(int8_t *pieceList, int pos);
         static bool pieceList_setEmpty(int8_t*pieceList, int pos, int sd);
         static bool pieceList_setEmpty(int8_t *pieceList, int pos, PieceType type, Side side);
         static bool pieceList_isThereAttacker(const int8_t *pieceList);
 
-        bool pieceList_make(const Hist& hist);
-        bool pieceList_takeback(const Hist& hist);
-
     private:
         std::string startingFen;
-        void xorHashKey(int pos);
-
-        u64 hashKey;
-
-        std::vector<Hist> histList;
+        std::vector<UndoRecord> undoList;
     };
 
 } // namespace opening
@@ -26,31 +26,307 @@
 #include "OpBook.h"
 #include "OpBoard.h"
 
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <thread>
+
+
+#if defined(__AVX2__) || defined(__SSE4_2__)
+#include <immintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 using namespace opening;
 
 ///////////////////////////////////////////////////////////////////////
 
+BookSearchIndex::BookSearchIndex()
+    : buf(nullptr), nodes(nullptr), itemCount(0), layerCount(0)
+{
+}
+
+BookSearchIndex::~BookSearchIndex()
+{
+    reset();
+}
+
+void BookSearchIndex::reset()
+{
+    if (buf) {
+        free(buf);
+    }
+    buf = nullptr;
+    nodes = nullptr;
+    itemCount = 0;
+    layerCount = 0;
+}
+
+bool BookSearchIndex::build(const BookItem* items, i64 itemCount_)
+{
+    reset();
+    if (itemCount_ <= 0) {
+        return false;
+    }
+
+    // node numbers of all layers, from the leaves up to a single root
+    i64 nodeCount = 0;
+    layerCount = 0;
+    for(i64 n = (itemCount_ + NodeKeyNumber - 1) / NodeKeyNumber; ; n = (n + NodeKeyNumber - 1) / NodeKeyNumber) {
+        assert(layerCount < MaxLayerNumber);
+        layerStarts[layerCount++] = nodeCount;
+        nodeCount += n;
+        if (n == 1) {
+            break;
+        }
+    }
+
+    // 64-byte aligned
+    auto sz = nodeCount * NodeKeyNumber * sizeof(u64);
+    buf = malloc(sz + 64);
+    if (!buf) {
+        layerCount = 0;
+        return false;
+    }
+    nodes = (u64*)(((uintptr_t)buf + 63) & ~(uintptr_t)63);
+    itemCount = itemCount_;
+
+    // leaves, padded with the largest key
+    i64 leafKeyCount = (layerCount > 1 ? layerStarts[1] : nodeCount) * NodeKeyNumber;
+    for(i64 i = 0; i < leafKeyCount; i++) {
+        nodes[i] = i < itemCount ? items[i].key() : UINT64_MAX;
+    }
+
+    for(int l = 1; l < layerCount; l++) {
+        auto lower = nodes + layerStarts[l - 1] * NodeKeyNumber;
+        i64 lowerCount = layerStarts[l] - layerStarts[l - 1];
+        auto p = nodes + layerStarts[l] * NodeKeyNumber;
+        i64 n = l + 1 < layerCount ? layerStarts[l + 1] - layerStarts[l] : nodeCount - layerStarts[l];
+        for(i64 i = 0; i < n * NodeKeyNumber; i++) {
+            p[i] = i < lowerCount ? lower[i * NodeKeyNumber + NodeKeyNumber - 1] : UINT64_MAX;
+        }
+    }
+    return true;
+}
+
+// Number of keys of a node less than a given key. Keys of a node are sorted
+int BookSearchIndex::countLess(const u64* node, u64 key)
+{
+#if defined(__AVX2__)
+    // compare as signed numbers
+    const __m256i signBit = _mm256_set1_epi64x((long long)0x8000000000000000ULL);
+    __m256i x = _mm256_set1_epi64x((long long)(key ^ 0x8000000000000000ULL));
+    __m256i a = _mm256_xor_si256(_mm256_load_si256((const __m256i*)node), signBit);
+    __m256i b = _mm256_xor_si256(_mm256_load_si256((const __m256i*)(node + 4)), signBit);
+    int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(x, a)))
+             | _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(x, b))) << 4;
+#elif defined(__SSE4_2__)
+    const __m128i signBit = _mm_set1_epi64x((long long)0x8000000000000000ULL);
+    __m128i x = _mm_set1_epi64x((long long)(key ^ 0x8000000000000000ULL));
+    int mask = 0;
+    for(int i = 0; i < NodeKeyNumber; i += 2) {
+        __m128i a = _mm_xor_si128(_mm_load_si128((const __m128i*)(node + i)), signBit);
+        mask |= _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(x, a))) << i;
+    }
+#else
+    int cnt = 0;
+    for(int i = 0; i < NodeKeyNumber; i++) {
+        cnt += node[i] < key;
+    }
+    return cnt;
+#endif
+
+#if defined(__AVX2__) || defined(__SSE4_2__)
+#ifdef _MSC_VER
+    return __popcnt(mask);
+#else
+    return __builtin_popcount(mask);
+#endif
+#endif
+}
+
+i64 BookSearchIndex::find(u64 key) const
+{
+    i64 idx;
+    find(&key, &idx, 1);
+    return idx;
+}
+
+// All keys go down the tree together, one layer at a time
+void BookSearchIndex::find(const u64* keys, i64* idxs, int n) const
+{
+    for(int k = 0; k < n; k++) {
+        idxs[k] = 0;
+    }
+
+    for(int l = layerCount - 1; l >= 0; l--) {
+        auto layer = nodes + layerStarts[l] * NodeKeyNumber;
+        for(int k = 0; k < n; k++) {
+            if (idxs[k] < 0) {
+                continue;
+            }
+            auto c = countLess(layer + idxs[k] * NodeKeyNumber, keys[k]);
+            idxs[k] = c < NodeKeyNumber ? idxs[k] * NodeKeyNumber + c : -1;
+        }
+    }
+
+    for(int k = 0; k < n; k++) {
+        if (idxs[k] >= itemCount || (idxs[k] >= 0 && nodes[idxs[k]] != keys[k])) {
+            idxs[k] = -1;
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////
+
+BookBloomFilter::BookBloomFilter()
+    : buf(nullptr), blocks(nullptr), blockCount(0)
+{
+}
+
+BookBloomFilter::~BookBloomFilter()
+{
+    reset();
+}
+
+void BookBloomFilter::reset()
+{
+    if (buf) {
+        free(buf);
+        buf = nullptr;
+    }
+    blocks = nullptr;
+    blockCount = 0;
+}
+
+i64 BookBloomFilter::blockNumber(i64 itemCount)
+{
+    const i64 blockBits = BlockWordNumber * 64;
+    return MAX((i64)1, (itemCount * BitsPerKey + blockBits - 1) / blockBits);
+}
+
+bool BookBloomFilter::create(i64 blockCount_)
+{
+    reset();
+    if (blockCount_ <= 0 || blockCount_ > UINT32_MAX) {
+        return false;
+    }
+
+    // 64-byte aligned
+    auto sz = blockCount_ * BlockWordNumber * sizeof(u64);
+    buf = malloc(sz + 64);
+    if (!buf) {
+        return false;
+    }
+    blocks = (u64*)(((uintptr_t)buf + 63) & ~(uintptr_t)63);
+    memset(blocks, 0, sz);
+    blockCount = blockCount_;
+    return true;
+}
+
+void BookBloomFilter::attach(const u64* data, i64 blockCount_)
+{
+    reset();
+    blocks = (u64*)data;
+    blockCount = blockCount_;
+}
+
+// Keys don't include the side to move, it is mixed in here
+u64 BookBloomFilter::hash(u64 key, int sd)
+{
+    key ^= sd ? 0x9e3779b97f4a7c15ULL : 0;
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+// The high 32 bits select the block. Bits in the block are 9-bit groups of the top of another product,
+// which mixes in the low bits, thus they don't follow the block bits (those are nearly the same in a block)
+void BookBloomFilter::add(u64 key, int sd)
+{
+    auto h = hash(key, sd);
+    auto block = blocks + (((h >> 32) * (u64)blockCount) >> 32) * BlockWordNumber;
+    auto probes = (h * ProbeMultiplier) >> (64 - ProbeNumber * 9);
+    for(int i = 0; i < ProbeNumber; i++, probes >>= 9) {
+        auto bit = probes & 511;
+        block[bit >> 6] |= 1ULL << (bit & 63);
+    }
+}
+
+bool BookBloomFilter::mayContain(u64 key, int sd) const
+{
+    auto h = hash(key, sd);
+    auto block = blocks + (((h >> 32) * (u64)blockCount) >> 32) * BlockWordNumber;
+    auto probes = (h * ProbeMultiplier) >> (64 - ProbeNumber * 9);
+    u64 missing = 0;
+    for(int i = 0; i < ProbeNumber; i++, probes >>= 9) {
+        auto bit = probes & 511;
+        missing |= ~block[bit >> 6] & (1ULL << (bit & 63));
+    }
+    return missing == 0;
+}
+
+///////////////////////////////////////////////////////////////////////
+
 OpBookCore::OpBookCore() :
+    mappedFile(nullptr),
     path("")
 {
     assert(sizeof(BookItem) == 10);
     bookData[0] = bookData[1] = nullptr;
+    allocatedSizes[0] = allocatedSizes[1] = 0;
 }
 
 OpBookCore::~OpBookCore()
 {
-    if (bookData[0]) {
+    freeData();
+}
+
+void OpBookCore::freeData()
+{
+    for(int i = 0; i < 2; i++) {
+        searchIndex[i].reset();
+    }
+    bloomFilter.reset();
+
+    if (mappedFile) {
+        // bookData point to the mapped memory
+        delete mappedFile;
+        mappedFile = nullptr;
+    } else {
         for(int i = 0; i < 2; i++) {
-            free(bookData[i]);
-            bookData[i] = nullptr;
+            if (bookData[i]) {
+                free(bookData[i]);
+            }
         }
     }
+
+    bookData[0] = bookData[1] = nullptr;
+    allocatedSizes[0] = allocatedSizes[1] = 0;
 }
 
-bool OpBookCore::load(const std::string& path_) {
+bool OpBookCore::load(const std::string& path_, bool mmapMode, bool indexed) {
+    freeData();
     path = path_;
 
+    auto ok = mmapMode ? loadMapped() : loadData();
+
+    // the index is optional, the book works without it
+    if (ok && indexed && !buildSearchIndex()) {
+        for(int sd = 0; sd < 2; sd++) {
+            searchIndex[sd].reset();
+        }
+    }
+    return ok;
+}
+
+bool OpBookCore::loadData() {
     std::ifstream file(path, std::ios::binary);
 
     if (!header.readFile(file)) {
@@ -68,12 +344,21 @@ bool OpBookCore::load(const std::string& path_) {
         bookData[sd] = (BookItem*)malloc(allocatedSizes[sd] * sizeof(BookItem) + 32);
 
         i64 dataSz = header.size[sd] * sizeof(BookItem);
-        if (!file.read((char*)bookData[sd], dataSz)) {
+        if (!file.seekg(header.dataOffset(sd)) || !file.read((char*)bookData[sd], dataSz)) {
             ok = false;
             break;
         }
     }
 
+    // the filter is optional, the book works without it
+    if (ok && header.hasBloomFilter()) {
+        if (!bloomFilter.create(header.filterBlocks)
+            || !file.seekg(header.filterOffset())
+            || !file.read((char*)bloomFilter.getData(), bloomFilter.getByteSize())) {
+            bloomFilter.reset();
+        }
+    }
+
     file.close();
 
     if (!ok && openingVerbose) {
@@ -82,6 +367,242 @@ bool OpBookCore::load(const std::string& path_) {
     return ok;
 }
 
+bool OpBookCore::loadMapped() {
+    mappedFile = new MemMappedFile();
+
+    bool ok = mappedFile->open(path) && mappedFile->getSize() >= BookHeader::BookHeaderSz;
+    if (ok) {
+        memcpy(&header.signature, mappedFile->getData(), BookHeader::BookHeaderSz);
+        ok = header.isValid();
+    }
+
+    for(int sd = 0; sd < 2 && ok; sd++) {
+        if (header.size[sd] <= 0) {
+            continue;
+        }
+        auto offset = header.dataOffset(sd);
+        if (offset + header.size[sd] * (i64)sizeof(BookItem) > mappedFile->getSize()) {
+            ok = false;
+            break;
+        }
+        bookData[sd] = (BookItem*)(mappedFile->getData() + offset);
+    }
+
+    if (ok && header.hasBloomFilter()) {
+        auto offset = header.filterOffset();
+        i64 blockCount = header.filterBlocks;
+        if (offset + blockCount * BookBloomFilter::BlockWordNumber * (i64)sizeof(u64) <= mappedFile->getSize()) {
+            bloomFilter.attach((const u64*)(mappedFile->getData() + offset), blockCount);
+        }
+    }
+
+    if (!ok) {
+        freeData();
+        if (openingVerbose) {
+            std::cerr << "Error: cannot map " << path << std::endl;
+        }
+    }
+    return ok;
+}
+
+bool OpBookCore::buildSearchIndex() {
+    bool ok = true;
+    for(int sd = 0; sd < 2; sd++) {
+        searchIndex[sd].reset();
+        if (header.size[sd] > 0 && !header.isHashedData() && !searchIndex[sd].build(bookData[sd], header.size[sd])) {
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+// Keys in the book and their neighbours, which are usually not, are looked up both ways
+bool OpBookCore::crossCheckSearchIndex(int sd) const
+{
+    if (searchIndex[sd].isEmpty()) {
+        return true;
+    }
+
+    auto data = (const char*)bookData[sd];
+    auto n = header.size[sd];
+    for(i64 i = 0; i < n; i++) {
+        auto key = bookData[sd][i].key();
+        for(int k = 0; k < 2; k++, key++) {
+            auto idx0 = find(key, data, n, sizeof(BookItem));
+            auto idx1 = searchIndex[sd].find(key);
+            if ((idx0 < 0) != (idx1 < 0) || (idx1 >= 0 && bookData[sd][idx1].key() != key)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool OpBookCore::buildBloomFilter() {
+    i64 itemCount = 0;
+    for(int sd = 0; sd < 2; sd++) {
+        for(i64 i = 0; i < header.size[sd]; i++) {
+            if (bookData[sd][i].key() != 0) {
+                itemCount++;
+            }
+        }
+    }
+
+    if (!bloomFilter.create(BookBloomFilter::blockNumber(itemCount))) {
+        return false;
+    }
+
+    for(int sd = 0; sd < 2; sd++) {
+        for(i64 i = 0; i < header.size[sd]; i++) {
+            auto key = bookData[sd][i].key();
+            if (key != 0) {
+                bloomFilter.add(key, sd);
+            }
+        }
+    }
+    return true;
+}
+
+// Add a Bloom filter to a book file without loading its data, items are read in chunks
+bool OpBookCore::addBloomFilter(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    BookHeader header;
+    if (!header.readFile(file)) {
+        return false;
+    }
+
+    const i64 chunkSize = 64 * 1024;
+    std::vector<BookItem> items(chunkSize);
+
+    BookBloomFilter bloomFilter;
+    bool ok = true;
+
+    // the first pass counts keys, the second one adds them
+    i64 itemCount = 0;
+    for(int pass = 0; pass < 2 && ok; pass++) {
+        if (pass == 0 && !header.isHashedData()) {
+            itemCount = header.size[0] + header.size[1];
+            continue;
+        }
+        if (pass == 1 && !bloomFilter.create(BookBloomFilter::blockNumber(itemCount))) {
+            ok = false;
+            break;
+        }
+
+        for(int sd = 0; sd < 2 && ok; sd++) {
+            if (header.size[sd] <= 0 || !file.seekg(header.dataOffset(sd))) {
+                continue;
+            }
+            for(i64 i = 0; i < header.size[sd]; i += chunkSize) {
+                auto n = MIN(chunkSize, header.size[sd] - i);
+                if (!file.read((char*)items.data(), n * sizeof(BookItem))) {
+                    ok = false;
+                    break;
+                }
+                for(i64 j = 0; j < n; j++) {
+                    auto key = items[j].key();
+                    if (key == 0) {
+                        continue;
+                    }
+                    if (pass == 0) {
+                        itemCount++;
+                    } else {
+                        bloomFilter.add(key, sd);
+                    }
+                }
+            }
+        }
+    }
+    file.close();
+
+    if (!ok) {
+        return false;
+    }
+
+    std::ofstream outfile(path, std::ios::binary | std::ios::in | std::ios::out);
+    header.property |= BookHeader::PropertyBloomFilter;
+    header.filterBlocks = (u32)bloomFilter.getBlockCount();
+
+    outfile.seekp(0, std::ios::end);
+    ok = header.saveFile(outfile)
+        && outfile.seekp(0, std::ios::end)
+        && writePadding(outfile, header.filterOffset())
+        && outfile.seekp(header.filterOffset())
+        && outfile.write((const char*)bloomFilter.getData(), bloomFilter.getByteSize());
+    outfile.close();
+    return ok;
+}
+
+bool OpBookCore::convertData(bool hashed) {
+    // mapped data is read only
+    if (mappedFile) {
+        return false;
+    }
+
+    if (header.isHashedData() == hashed) {
+        return true;
+    }
+
+    for(int sd = 0; sd < 2; sd++) {
+        searchIndex[sd].reset();
+
+        i64 n = header.size[sd];
+        if (n <= 0) {
+            continue;
+        }
+
+        i64 newSize;
+        BookItem* newData;
+        if (hashed) {
+            newSize = hashedCapacity(n);
+            newData = (BookItem*)malloc(newSize * sizeof(BookItem) + 32);
+            if (!newData) {
+                return false;
+            }
+            buildHashedData(bookData[sd], n, newData, newSize);
+        } else {
+            newData = (BookItem*)malloc(n * sizeof(BookItem) + 32);
+            if (!newData) {
+                return false;
+            }
+            newSize = 0;
+            for(i64 i = 0; i < n; i++) {
+                if (bookData[sd][i].key() != 0) {
+                    newData[newSize++] = bookData[sd][i];
+                }
+            }
+            std::sort(newData, newData + newSize, [](const BookItem& a, const BookItem& b) { return a.key() < b.key(); });
+        }
+
+        free(bookData[sd]);
+        bookData[sd] = newData;
+        header.size[sd] = newSize;
+        allocatedSizes[sd] = newSize;
+    }
+
+    if (hashed) {
+        header.property |= BookHeader::PropertyHashedData;
+    } else {
+        header.property &= ~BookHeader::PropertyHashedData;
+    }
+    return true;
+}
+
+bool OpBookCore::convert(const std::string& inPath, const std::string& outPath, bool hashed) {
+    OpBookCore book;
+    return book.load(inPath) && book.convertData(hashed) && book.save(outPath);
+}
+
+bool OpBookCore::writePadding(std::ofstream& outfile, i64 offset) {
+    static const char zeros[256] = { 0 };
+    for(i64 pos = outfile.tellp(); pos < offset && outfile; ) {
+        auto n = MIN(offset - pos, (i64)sizeof(zeros));
+        outfile.write(zeros, n);
+        pos += n;
+    }
+    return !outfile.fail();
+}
+
 bool OpBookCore::save(std::string path_) {
     if (path_.empty()) {
         path_ = path;
@@ -93,6 +614,14 @@ bool OpBookCore::save(std::string path_) {
     assert(header.isValid());
     assert(header.size[0] + header.size[1] > 0);
 
+    if (bloomFilter.isEmpty()) {
+        header.property &= ~BookHeader::PropertyBloomFilter;
+        header.filterBlocks = 0;
+    } else {
+        header.property |= BookHeader::PropertyBloomFilter;
+        header.filterBlocks = (u32)bloomFilter.getBlockCount();
+    }
+
     bool ok = true;
 
     if (!header.saveFile(outfile)) {
@@ -101,12 +630,17 @@ bool OpBookCore::save(std::string path_) {
         for(int sd = 0; sd < 2 && ok; sd++) {
             if (header.size[sd]) {
                 i64 dataSz = header.size[sd] * sizeof(BookItem);
-                if (!outfile.write((const char*)bookData[sd], dataSz)) {
+                if (!writePadding(outfile, header.dataOffset(sd)) || !outfile.write((const char*)bookData[sd], dataSz)) {
                     ok = false;
                     break;
                 }
             }
         }
+
+        if (ok && !bloomFilter.isEmpty()) {
+            ok = writePadding(outfile, header.filterOffset())
+                && outfile.write((const char*)bloomFilter.getData(), bloomFilter.getByteSize());
+        }
     }
 
     if (!ok && openingVerbose) {
@@ -133,6 +667,15 @@ int OpBookCore::getValueByKey(u64 key, int sd) const
 
 i64 OpBookCore::find(u64 key, int sd) const
 {
+    if (!bloomFilter.isEmpty() && !bloomFilter.mayContain(key, sd)) {
+        return -1;
+    }
+    if (header.isHashedData()) {
+        return findHashed(key, bookData[sd], header.size[sd]);
+    }
+    if (!searchIndex[sd].isEmpty()) {
+        return searchIndex[sd].find(key);
+    }
     return find(key, (const char*)bookData[sd], header.size[sd], sizeof(BookItem));
 }
 
@@ -154,67 +697,219 @@ i64 OpBookCore::find(u64 key, const char* data, i64 itemCount, int itemSize)
     return -1;
 }
 
-Move OpBookCore::probe(const std::string& fen, MoveList* opMoveList) const
+void OpBookCore::getValuesByKeys(const u64* keys, int* values, int n, int sd) const
 {
-    OpeningBoard board;
-    board.setFen(fen);
-    return probe(board);
+    i64 idxs[MoveList::MaxMoveNumber];
+    for(int k = 0; k < n; k += MoveList::MaxMoveNumber) {
+        auto m = MIN(n - k, MoveList::MaxMoveNumber);
+        find(keys + k, idxs, m, sd);
+        for(int i = 0; i < m; i++) {
+            values[k + i] = idxs[i] >= 0 ? bookData[sd][idxs[i]].value : -1;
+        }
+    }
 }
 
-Move OpBookCore::probe(const int8_t* pieceList, Side side, MoveList* opMoveList) const
+void OpBookCore::find(const u64* keys, i64* idxs, int n, int sd) const
 {
-    OpeningBoard board;
-    board.pieceList_setupBoard(pieceList);
-    board.side = side;
-    return probe(board, opMoveList);
+    if (bloomFilter.isEmpty()) {
+        findUnfiltered(keys, idxs, n, sd);
+        return;
+    }
+
+    // only keys passing the filter are searched, usually none of them once out of book
+    u64 passedKeys[MoveList::MaxMoveNumber];
+    i64 passedIdxs[MoveList::MaxMoveNumber];
+    int passedPos[MoveList::MaxMoveNumber];
+
+    for(int k = 0; k < n; k += MoveList::MaxMoveNumber) {
+        auto m = MIN(n - k, MoveList::MaxMoveNumber);
+        int passedCnt = 0;
+        for(int i = 0; i < m; i++) {
+            idxs[k + i] = -1;
+            if (bloomFilter.mayContain(keys[k + i], sd)) {
+                passedKeys[passedCnt] = keys[k + i];
+                passedPos[passedCnt++] = k + i;
+            }
+        }
+        if (passedCnt > 0) {
+            findUnfiltered(passedKeys, passedIdxs, passedCnt, sd);
+            for(int i = 0; i < passedCnt; i++) {
+                idxs[passedPos[i]] = passedIdxs[i];
+            }
+        }
+    }
 }
 
-Move OpBookCore::probe(const MoveList& moveList, MoveList* opMoveList) const
+void OpBookCore::findUnfiltered(const u64* keys, i64* idxs, int n, int sd) const
 {
-    OpeningBoard board;
-    board.setFen("");
-    for(int i = 0; i < moveList.end; i++) {
-        auto move = moveList.list[i];
-        board.make(move);
+    if (header.isHashedData()) {
+        for(int k = 0; k < n; k++) {
+            idxs[k] = findHashed(keys[k], bookData[sd], header.size[sd]);
+        }
+        return;
     }
-    return probe(board, opMoveList);
+    if (!searchIndex[sd].isEmpty()) {
+        searchIndex[sd].find(keys, idxs, n);
+        return;
+    }
+    find(keys, idxs, n, (const char*)bookData[sd], header.size[sd], sizeof(BookItem));
 }
 
-Move OpBookCore::probe(const std::vector<Piece> pieceVec, Side side, MoveList* opMoveList) const
+// Load factor is kept under 3/4, keys are Zobrist hashes thus their low bits are used as slots
+i64 OpBookCore::hashedCapacity(i64 itemCount)
 {
-    OpeningBoard board;
-    board.setup(pieceVec, side);
-    return probe(board, opMoveList);
+    i64 capacity = 16;
+    while (capacity * 3 / 4 <= itemCount) {
+        capacity <<= 1;
+    }
+    return capacity;
 }
 
-Move OpBookCore::probe(OpeningBoard& board, MoveList* opMoveList) const
+void OpBookCore::buildHashedData(const BookItem* items, i64 itemCount, BookItem* table, i64 capacity)
+{
+    memset(table, 0, capacity * sizeof(BookItem));
+
+    auto mask = capacity - 1;
+    for(i64 j = 0; j < itemCount; j++) {
+        auto key = items[j].key();
+        assert(key != 0);
+        auto i = (i64)(key & mask);
+        while (table[i].key() != 0) {
+            i = (i + 1) & mask;
+        }
+        table[i] = items[j];
+    }
+}
+
+i64 OpBookCore::findHashed(u64 key, const BookItem* table, i64 capacity)
+{
+    if (key == 0 || capacity <= 0) {
+        return -1;
+    }
+
+    auto mask = capacity - 1;
+    for(auto i = (i64)(key & mask); ; i = (i + 1) & mask) {
+        auto theKey = table[i].key();
+        if (theKey == key) {
+            return i;
+        }
+        if (theKey == 0) {
+            return -1;
+        }
+    }
+}
+
+// Binary searches of all keys run in lockstep: at each level the probes of all keys are independent loads,
+// thus their cache misses overlap instead of being paid one after another
+void OpBookCore::find(const u64* keys, i64* idxs, int n, const char* data, i64 itemCount, int itemSize)
+{
+    if (itemCount <= 0) {
+        for(int k = 0; k < n; k++) {
+            idxs[k] = -1;
+        }
+        return;
+    }
+
+    // base: the last item not greater than the key, or 0
+    for(int k = 0; k < n; k++) {
+        idxs[k] = 0;
+    }
+
+    for(i64 len = itemCount; len > 1; ) {
+        i64 half = len / 2;
+        for(int k = 0; k < n; k++) {
+            auto idx = idxs[k] + half;
+            idxs[k] = *(const u64 *)(data + idx * itemSize) <= keys[k] ? idx : idxs[k];
+        }
+        len -= half;
+    }
+
+    for(int k = 0; k < n; k++) {
+        if (*(const u64 *)(data + idxs[k] * itemSize) != keys[k]) {
+            idxs[k] = -1;
+        }
+    }
+}
+
+Move OpBookCore::probe(const std::string& fen, MoveList* opMoveList) const
 {
-    auto bestmove = _probe(board, opMoveList);
+    return probe(fen.c_str(), opMoveList);
+}
 
+// Positions given by FENs and piece lists are set up without any heap allocation
+Move OpBookCore::probe(const char* fen, MoveList* opMoveList) const
+{
+    PositionCore position;
+    if (!position.setFen(fen)) {
+        if (opMoveList) {
+            opMoveList->reset();
+        }
+        return Move(-1, -1);
+    }
+    return probe(position, opMoveList);
+}
+
+Move OpBookCore::probe(const int8_t* pieceList, Side side, MoveList* opMoveList) const
+{
+    PositionCore position;
+    if (!position.setPieceList(pieceList, side)) {
+        if (opMoveList) {
+            opMoveList->reset();
+        }
+        return Move(-1, -1);
+    }
+    return probe(position, opMoveList);
+}
+
+Move OpBookCore::probe(const PositionCore& position, MoveList* opMoveList) const
+{
+    auto bestmove = _probe(position, opMoveList);
+
+    // Try keys of flipped boards, the moves are still of the board, only their keys are of the flipped positions.
+    // Canonical keys cover horizontal mirrors, thus the vertical flip covers the rotation too for those books
     if (!bestmove.isValid()) {
-        static const opening::FlipMode flips[] = { opening::FlipMode::horizontal, opening::FlipMode::vertical, opening::FlipMode::horizontal };
-
-        OpeningBoard newBoard(board);
-        for(int i = 0; i < 3; i++) {
-            auto flipMode = flips[i];
-            newBoard.flip(flipMode);
-            if (i == 2) {
-                newBoard.side = getXSide(board.side);
-            }
-            bestmove = _probe(board, opMoveList);
-            if (bestmove.isValid()) {
-                return bestmove;
-            }
+        static const opening::FlipMode allFlips[] = { opening::FlipMode::horizontal, opening::FlipMode::vertical, opening::FlipMode::rotate };
+        static const opening::FlipMode canonicalFlips[] = { opening::FlipMode::vertical };
+
+        auto flips = header.isCanonicalKeys() ? canonicalFlips : allFlips;
+        int flipCnt = header.isCanonicalKeys() ? 1 : 3;
+        for(int i = 0; i < flipCnt && !bestmove.isValid(); i++) {
+            bestmove = _probe(position, opMoveList, flips[i]);
         }
     }
 
     return bestmove;
 }
 
-Move OpBookCore::_probe(OpeningBoard& board, MoveList* opMoveList) const
+Move OpBookCore::probe(const MoveList& moveList, MoveList* opMoveList) const
+{
+    OpeningBoard board;
+    board.setFen("");
+    for(int i = 0; i < moveList.end; i++) {
+        auto move = moveList.list[i];
+        board.make(move);
+    }
+    return probe(board, opMoveList);
+}
+
+Move OpBookCore::probe(const std::vector<Piece> pieceVec, Side side, MoveList* opMoveList) const
+{
+    OpeningBoard board;
+    board.setup(pieceVec, side);
+    return probe(board, opMoveList);
+}
+
+Move OpBookCore::probe(OpeningBoard& board, MoveList* opMoveList) const
+{
+    return probe(static_cast<const PositionCore&>(board), opMoveList);
+}
+
+Move OpBookCore::_probe(const PositionCore& board, MoveList* opMoveList, FlipMode flipMode) const
 {
     auto side = board.side;
-    int sd = static_cast<int>(side);
+
+    // colours, thus the side to move, are swapped by vertical flips and rotations
+    int sd = static_cast<int>(flipMode == FlipMode::none || flipMode == FlipMode::horizontal ? side : getXSide(side));
 
     Move bestmove(-1, -1);
     if (header.size[sd] <= 0) {
@@ -228,43 +923,99 @@ Move OpBookCore::_probe(OpeningBoard& board, MoveList* opMoveList) const
         opMoveList->reset();
     }
 
-    u16 curValue = 0;
+    // Child keys are computed without making moves and looked up together.
+    // Only moves found in the book are checked for legality
+    u64 keys[MoveList::MaxMoveNumber];
+    int values[MoveList::MaxMoveNumber];
+    for(int i = 0; i < moveList.end; i++) {
+        keys[i] = board.keyAfterMove(moveList.list[i], flipMode);
+    }
+
+    // canonical keys: the smaller of keys of children and their mirrored ones
+    if (header.isCanonicalKeys()) {
+        auto mirroredMode = OpeningBoard::flip(flipMode, FlipMode::horizontal);
+        for(int i = 0; i < moveList.end; i++) {
+            keys[i] = MIN(keys[i], board.keyAfterMove(moveList.list[i], mirroredMode));
+        }
+    }
+    getValuesByKeys(keys, values, moveList.end, sd);
+
+    int curValue = 0; // values of the sum overlay could be over 16 bits
     for(int i = 0; i < moveList.end; i++) {
         auto move = moveList.list[i];
-        board.make(move);
-        if (!board.isIncheck(side)) {
-            auto value = getValueByKey(board.key(), sd);
-            if (value >= 0) {
-                move.score = value;
-                if (opMoveList) {
-                    opMoveList->add(move);
-                }
-                if (value > curValue) {
-                    curValue = value;
-                    bestmove = move;
-                }
-            }
-//            auto idx = find(board.key(), sd);
-//            if (idx >= 0) {
-//                auto value = bookData[sd][idx].value;
-//                move.score = value;
-//                if (opMoveList) {
-//                    opMoveList->add(move);
-//                }
-//                if (value > curValue) {
-//                    curValue = value;
-//                    bestmove = move;
-//                }
-//            }
-        }
-        board.takeBack();
+        auto value = values[i];
+        if (value < 0) {
+            continue;
+        }
+
+        if (board.isIncheckAfterMove(move)) {
+            continue;
+        }
+
+        move.score = value;
+        if (opMoveList) {
+            opMoveList->add(move);
+        }
+        if (value > curValue) {
+            curValue = value;
+            bestmove = move;
+        }
     }
 
     return bestmove;
 }
 
+u64 OpBookCore::bookKey(const PositionCore& board) const
+{
+    auto key = board.key();
+    return header.isCanonicalKeys() ? MIN(key, board.key(FlipMode::horizontal)) : key;
+}
+
+u64 OpBookCore::bookKeyAfterMove(const PositionCore& board, const Move& move) const
+{
+    auto key = board.keyAfterMove(move);
+    return header.isCanonicalKeys() ? MIN(key, board.keyAfterMove(move, FlipMode::horizontal)) : key;
+}
+
+bool OpBookCore::copyData(const OpBookCore& other)
+{
+    freeData();
+
+    header = other.header;
+    path = other.path;
+
+    for(int sd = 0; sd < 2; sd++) {
+        if (header.size[sd] <= 0) {
+            continue;
+        }
+        allocatedSizes[sd] = header.size[sd];
+        bookData[sd] = (BookItem*)malloc(allocatedSizes[sd] * sizeof(BookItem) + 32);
+        if (!bookData[sd]) {
+            return false;
+        }
+        memcpy(bookData[sd], other.bookData[sd], header.size[sd] * sizeof(BookItem));
+    }
+
+    return (!other.hasBloomFilter() || buildBloomFilter())
+        && ((other.searchIndex[0].isEmpty() && other.searchIndex[1].isEmpty()) || buildSearchIndex());
+}
+
+// Write a single value into the book file, the data in memory is not changed
+bool OpBookCore::writeValue(i64 idx, int value, int sd) const
+{
+    std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+    u16 v = value;
+    return file.seekp(header.dataOffset(sd) + idx * (i64)sizeof(BookItem) + offsetof(BookItem, value))
+        && file.write((const char*)&v, sizeof(v));
+}
+
 bool OpBookCore::_updateValue(u64 key, int value, Side side)
 {
+    // mapped data is read only
+    if (mappedFile) {
+        return false;
+    }
+
     int sd = static_cast<int>(side);
     i64 idx = find(key, sd);
     if (idx < 0) {
@@ -279,74 +1030,510 @@ bool OpBookCore::_updateValue(u64 key, int value, Side side)
 }
 
 
+///////////////////////////////////////////////////////////////////////
+
+SnapshotDomain::SnapshotDomain()
+    : epoch(0)
+{
+    for(int i = 0; i < SlotNumber; i++) {
+        slots[i].counts[0] = 0;
+        slots[i].counts[1] = 0;
+    }
+}
+
+int SnapshotDomain::slotIndex()
+{
+    static std::atomic<int> nextSlot(0);
+    static thread_local int slot = nextSlot.fetch_add(1) % SlotNumber;
+    return slot;
+}
+
+int SnapshotDomain::enter() const
+{
+    auto slot = slotIndex();
+    auto parity = epoch.load() & 1;
+    slots[slot].counts[parity].fetch_add(1);
+    return slot * 2 + parity;
+}
+
+void SnapshotDomain::leave(int token) const
+{
+    slots[token >> 1].counts[token & 1].fetch_sub(1);
+}
+
+// Readers which could see the old snapshot have entered before it was replaced, with either parity.
+// New readers go to the other parity while one is drained, thus both are drained in turn
+void SnapshotDomain::synchronize()
+{
+    for(int round = 0; round < 2; round++) {
+        auto parity = epoch.fetch_add(1) & 1;
+        for(int i = 0; i < SlotNumber; i++) {
+            while (slots[i].counts[parity].load() != 0) {
+                std::this_thread::yield();
+            }
+        }
+    }
+}
+
+int OpBookSnapshot::findUpdate(const std::vector<BookItem>& updates, u64 key)
+{
+    if (updates.empty()) {
+        return -1;
+    }
+    auto it = std::lower_bound(updates.begin(), updates.end(), key, [](const BookItem& item, u64 k) { return item.key() < k; });
+    return it != updates.end() && it->key() == key ? it->value : -1;
+}
+
+void OpBookSnapshot::setUpdate(std::vector<BookItem>& updates, u64 key, int value)
+{
+    auto it = std::lower_bound(updates.begin(), updates.end(), key, [](const BookItem& item, u64 k) { return item.key() < k; });
+    if (it != updates.end() && it->key() == key) {
+        it->value = value;
+    } else {
+        BookItem item;
+        item.set(key, value);
+        updates.insert(it, item);
+    }
+}
+
+const BookOverlayItem* BookOverlay::find(u64 key, int sd) const
+{
+    if (!bloomFilter.mayContain(key, sd)) {
+        return nullptr;
+    }
+    auto& vec = items[sd];
+    auto it = std::lower_bound(vec.begin(), vec.end(), key, [](const BookOverlayItem& item, u64 k) { return item.key < k; });
+    return it != vec.end() && it->key == key ? &(*it) : nullptr;
+}
+
+int OpBookSnapshot::getLayerValue(size_t layerIdx, u64 key, int sd) const
+{
+    auto& book = layers[layerIdx].book;
+    if (book == learntBook) {
+        auto value = findUpdate(learntUpdates[sd], key);
+        if (value >= 0) {
+            return value;
+        }
+    }
+    return book->getValueByKey(key, sd);
+}
+
+BookOverlayItem OpBookSnapshot::resolve(u64 key, int sd) const
+{
+    BookOverlayItem item;
+    item.key = key;
+    item.value = 0;
+    item.overMain = true;
+
+    for(size_t i = 0; i < layers.size(); i++) {
+        auto value = getLayerValue(i, key, sd);
+        if (value < 0) {
+            continue;
+        }
+        if (layers[i].policy == BookLayerPolicy::override) {
+            item.value = value;
+            item.overMain = false;
+        } else {
+            item.value += value;
+        }
+    }
+    return item;
+}
+
+// All keys of layers are resolved and sorted. Overlay updates are then no longer needed
+bool OpBookSnapshot::buildOverlay()
+{
+    overlayUpdates[0].clear();
+    overlayUpdates[1].clear();
+
+    if (layers.empty()) {
+        overlay.reset();
+        return true;
+    }
+
+    auto newOverlay = std::make_shared<BookOverlay>();
+    i64 itemCount = 0;
+    for(int sd = 0; sd < 2; sd++) {
+        std::vector<u64> keys;
+        for(auto && layer : layers) {
+            auto& book = layer.book;
+            auto data = book->getData(sd);
+            for(i64 i = 0; i < book->getHeader()->size[sd]; i++) {
+                if (data[i].key() != 0) {
+                    keys.push_back(data[i].key());
+                }
+            }
+        }
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+        auto& items = newOverlay->items[sd];
+        items.reserve(keys.size());
+        for(auto && key : keys) {
+            items.push_back(resolve(key, sd));
+        }
+        itemCount += items.size();
+    }
+
+    if (!newOverlay->bloomFilter.create(BookBloomFilter::blockNumber(itemCount))) {
+        return false;
+    }
+    for(int sd = 0; sd < 2; sd++) {
+        for(auto && item : newOverlay->items[sd]) {
+            newOverlay->bloomFilter.add(item.key, sd);
+        }
+    }
+
+    overlay = newOverlay;
+    return true;
+}
+
+void OpBookSnapshot::applyOverlay(const u64* keys, int* values, int n, int sd) const
+{
+    if (!overlay) {
+        return;
+    }
+
+    auto& updates = overlayUpdates[sd];
+    for(int i = 0; i < n; i++) {
+        const BookOverlayItem* item = nullptr;
+        if (!updates.empty()) {
+            auto it = std::lower_bound(updates.begin(), updates.end(), keys[i], [](const BookOverlayItem& item, u64 k) { return item.key < k; });
+            if (it != updates.end() && it->key == keys[i]) {
+                item = &(*it);
+            }
+        }
+        if (!item) {
+            item = overlay->find(keys[i], sd);
+        }
+        if (item) {
+            values[i] = item->apply(values[i]);
+        }
+    }
+}
+
 ///////////////////////////////////////////////////////////////////////
 
 OpBook::OpBook()
     : OpBookCore(),
-      learntBook(nullptr)
+      snapshot(new OpBookSnapshot()),
+      journalRecordCnt(0)
 {}
 
 OpBook::~OpBook()
 {
-    if (learntBook) {
-        delete learntBook;
-        learntBook = nullptr;
-    }
+    delete snapshot.load();
 }
 
-bool OpBook::load(const std::string& path)
+bool OpBook::load(const std::string& path, bool mmapMode, bool indexed)
 {
-    if (learntBook) {
-        delete learntBook;
-        learntBook = nullptr;
-    }
+    auto newSnapshot = new OpBookSnapshot();
+    delete snapshot.exchange(newSnapshot);
 
-    auto r = OpBookCore::load(path);
+    journalFile.close();
+    journalRecordCnt = 0;
+
+    auto r = OpBookCore::load(path, mmapMode, indexed);
 
     // Load learnt file
     if (r) {
-        std::string learntPath = path;
+        learntPath = path;
 
         auto dot = learntPath.find_last_of(".");
         if (dot > 0) {
             learntPath = learntPath.substr(0, dot);
         }
+        journalPath = learntPath + LearntJournalFileExtension;
         learntPath += LearntFileExtension;
 
-        learntBook = new OpBookCore();
-        if (!learntBook->load(learntPath)) {
-            delete learntBook;
-            learntBook = nullptr;
+        // learnt data is updated frequently, it is always loaded into memory
+        auto learntBook = std::make_shared<OpBookCore>();
+        if (learntBook->load(learntPath)) {
+            if (!learntBook->hasBloomFilter()) {
+                // it is small and checked for every probe
+                learntBook->buildBloomFilter();
+            }
+            newSnapshot->learntBook = learntBook;
+            replayLearntJournal(newSnapshot);
+
+            BookLayer layer;
+            layer.book = learntBook;
+            layer.policy = BookLayerPolicy::override;
+            newSnapshot->layers.push_back(layer);
+            newSnapshot->buildOverlay();
         }
     }
 
     return r;
 }
 
+bool OpBook::addLayer(const std::string& path, BookLayerPolicy policy, bool mmapMode)
+{
+    std::lock_guard<std::mutex> lock(updateMutex);
+
+    BookLayer layer;
+    auto book = std::make_shared<OpBookCore>();
+    if (!book->load(path, mmapMode)) {
+        return false;
+    }
+    layer.book = book;
+    layer.policy = policy;
+
+    auto newSnapshot = new OpBookSnapshot(*snapshot.load());
+    newSnapshot->layers.push_back(layer);
+    if (!newSnapshot->buildOverlay()) {
+        delete newSnapshot;
+        return false;
+    }
+    publish(newSnapshot);
+    return true;
+}
+
+// Updates of the journal, written by previous sessions, are applied in order. An incomplete
+// last record (such as of a crash while writing) is ignored
+void OpBook::replayLearntJournal(OpBookSnapshot* newSnapshot)
+{
+    std::ifstream file(journalPath, std::ios::binary);
+    LearntJournalRecord record;
+    while (file.read((char*)&record, sizeof(record))) {
+        int sd = record.side;
+        if (sd < 2 && newSnapshot->learntBook->find(record.key, sd) >= 0) {
+            OpBookSnapshot::setUpdate(newSnapshot->learntUpdates[sd], record.key, record.value);
+            journalRecordCnt++;
+        }
+    }
+}
+
+void OpBook::publish(OpBookSnapshot* newSnapshot)
+{
+    auto oldSnapshot = snapshot.exchange(newSnapshot);
+    snapshotDomain.synchronize();
+    delete oldSnapshot;
+}
+
+// Updates never change published data. Values are kept in new snapshots, main values are also
+// written into the book file, learnt ones are appended to the journal
 bool OpBook::updateValue(u64 key, int value, Side side, int saveTo)
 {
-    if (saveTo == 0) {
-        return _updateValue(key, value, side);
+    std::lock_guard<std::mutex> lock(updateMutex);
+
+    int sd = static_cast<int>(side);
+    return saveTo == 0 ? updateMainValue(key, value, sd) : updateLearntValue(key, value, sd);
+}
+
+bool OpBook::updateMainValue(u64 key, int value, int sd)
+{
+    // mapped data is read only
+    if (isMapped()) {
+        return false;
     }
 
-    return learntBook ? learntBook->_updateValue(key, value, side) : false;
+    auto idx = find(key, sd);
+    if (idx < 0) {
+        return false;
+    }
+
+    auto current = snapshot.load();
+    auto oldValue = OpBookSnapshot::findUpdate(current->mainUpdates[sd], key);
+    if (oldValue < 0) {
+        oldValue = getValueByIndex(idx, sd);
+    }
+    if (oldValue == value || !writeValue(idx, value, sd)) {
+        return oldValue == value;
+    }
+
+    auto newSnapshot = new OpBookSnapshot(*current);
+    OpBookSnapshot::setUpdate(newSnapshot->mainUpdates[sd], key, value);
+    publish(newSnapshot);
+    return true;
+}
+
+bool OpBook::updateLearntValue(u64 key, int value, int sd)
+{
+    auto current = snapshot.load();
+    if (!current->learntBook) {
+        return false;
+    }
+
+    auto idx = current->learntBook->find(key, sd);
+    if (idx < 0) {
+        return false;
+    }
+
+    auto oldValue = OpBookSnapshot::findUpdate(current->learntUpdates[sd], key);
+    if (oldValue < 0) {
+        oldValue = current->learntBook->getValueByIndex(idx, sd);
+    }
+    if (oldValue == value) {
+        return true;
+    }
+
+    if (!journalFile.is_open()) {
+        journalFile.open(journalPath, std::ios::binary | std::ios::app);
+    }
+
+    LearntJournalRecord record;
+    memset(&record, 0, sizeof(record));
+    record.key = key;
+    record.value = value;
+    record.side = sd;
+    if (!journalFile.write((const char*)&record, sizeof(record)) || !journalFile.flush()) {
+        if (openingVerbose) {
+            std::cerr << "Error: cannot write learning journal " << journalPath << std::endl;
+        }
+        return false;
+    }
+    journalRecordCnt++;
+
+    auto newSnapshot = new OpBookSnapshot(*current);
+    OpBookSnapshot::setUpdate(newSnapshot->learntUpdates[sd], key, value);
+
+    // the key is resolved again through all layers
+    auto item = newSnapshot->resolve(key, sd);
+    auto& updates = newSnapshot->overlayUpdates[sd];
+    auto it = std::lower_bound(updates.begin(), updates.end(), key, [](const BookOverlayItem& item, u64 k) { return item.key < k; });
+    if (it != updates.end() && it->key == key) {
+        *it = item;
+    } else {
+        updates.insert(it, item);
+    }
+    publish(newSnapshot);
+
+    if (journalRecordCnt >= LearntJournalCompactingNumber) {
+        _compactLearntData();
+    }
+    return true;
+}
+
+bool OpBook::compactLearntData()
+{
+    std::lock_guard<std::mutex> lock(updateMutex);
+    return _compactLearntData();
+}
+
+// The learnt file is written to a temporary file then renamed, thus it is complete at any time.
+// The journal is emptied only after that
+bool OpBook::_compactLearntData()
+{
+    auto current = snapshot.load();
+    if (!current->learntBook) {
+        return false;
+    }
+    if (current->learntUpdates[0].empty() && current->learntUpdates[1].empty()) {
+        return true;
+    }
+
+    auto learntBook = std::make_shared<OpBookCore>();
+    if (!learntBook->copyData(*current->learntBook)) {
+        return false;
+    }
+    for(int sd = 0; sd < 2; sd++) {
+        for(auto && item : current->learntUpdates[sd]) {
+            auto idx = learntBook->find(item.key(), sd);
+            assert(idx >= 0);
+            learntBook->getData(sd)[idx].value = item.value;
+        }
+    }
+
+    auto tmpPath = learntPath + ".tmp";
+    if (!learntBook->save(tmpPath) || std::rename(tmpPath.c_str(), learntPath.c_str()) != 0) {
+        std::remove(tmpPath.c_str());
+        return false;
+    }
+
+    journalFile.close();
+    std::ofstream emptyFile(journalPath, std::ios::binary | std::ios::trunc);
+    emptyFile.close();
+    journalRecordCnt = 0;
+
+    auto newSnapshot = new OpBookSnapshot(*current);
+    for(auto && layer : newSnapshot->layers) {
+        if (layer.book == current->learntBook) {
+            layer.book = learntBook;
+        }
+    }
+    newSnapshot->learntBook = learntBook;
+    newSnapshot->learntUpdates[0].clear();
+    newSnapshot->learntUpdates[1].clear();
+    newSnapshot->buildOverlay();
+    publish(newSnapshot);
+    return true;
 }
 
+// Updated values replace those of found keys
+static void applyUpdates(const std::vector<BookItem>& updates, const u64* keys, int* values, int n)
+{
+    if (updates.empty()) {
+        return;
+    }
+    for(int i = 0; i < n; i++) {
+        if (values[i] >= 0) {
+            auto value = OpBookSnapshot::findUpdate(updates, keys[i]);
+            if (value >= 0) {
+                values[i] = value;
+            }
+        }
+    }
+}
 
 int OpBook::getValueByKeyFromMainData(u64 key, int sd) const
 {
-    return OpBookCore::getValueByKey(key, sd);
+    int value;
+    getValuesByKeysFromMainData(&key, &value, 1, sd);
+    return value;
 }
 
 
 int OpBook::getValueByKeyFromLearntData(u64 key, int sd) const
 {
-    return learntBook ? learntBook->getValueByKey(key, sd) : -1;
+    int value;
+    getValuesByKeysFromLearntData(&key, &value, 1, sd);
+    return value;
 }
 
 
 int OpBook::getValueByKey(u64 key, int sd) const
 {
-    int r = getValueByKeyFromLearntData(key, sd);
-    return r >= 0 ? r : getValueByKeyFromMainData(key, sd);
+    int value;
+    getValuesByKeys(&key, &value, 1, sd);
+    return value;
+}
+
+void OpBook::getValuesByKeysFromMainData(const u64* keys, int* values, int n, int sd) const
+{
+    OpBookCore::getValuesByKeys(keys, values, n, sd);
+
+    auto token = snapshotDomain.enter();
+    auto current = snapshot.load();
+    applyUpdates(current->mainUpdates[sd], keys, values, n);
+    snapshotDomain.leave(token);
+}
+
+
+void OpBook::getValuesByKeysFromLearntData(const u64* keys, int* values, int n, int sd) const
+{
+    auto token = snapshotDomain.enter();
+    auto current = snapshot.load();
+    if (current->learntBook) {
+        current->learntBook->getValuesByKeys(keys, values, n, sd);
+        applyUpdates(current->learntUpdates[sd], keys, values, n);
+    } else {
+        for(int i = 0; i < n; i++) {
+            values[i] = -1;
+        }
+    }
+    snapshotDomain.leave(token);
+}
+
+
+// Values of the main data, then of all layers resolved in one pass, all from the same snapshot
+void OpBook::getValuesByKeys(const u64* keys, int* values, int n, int sd) const
+{
+    OpBookCore::getValuesByKeys(keys, values, n, sd);
+
+    auto token = snapshotDomain.enter();
+    auto current = snapshot.load();
+    applyUpdates(current->mainUpdates[sd], keys, values, n);
+    current->applyOverlay(keys, values, n, sd);
+    snapshotDomain.leave(token);
 }
@@ -32,6 +32,8 @@
 #include <fstream>
 #include <mutex>
 #include <map>
+#include <atomic>
+#include <memory>
 
 #include "Opening.h"
 
@@ -48,9 +50,9 @@ namespace opening {
             return *((u64 *)_key);
         }
 
-        void set(u64 key, u16 value) {
+        void set(u64 key, u16 _value) {
             *((u64 *)_key) = key;
-            value = value;
+            value = _value;
         }
         void incValue(u64 key) {
             if (*((u64 *)_key) == key) {
@@ -67,6 +69,21 @@ namespace opening {
         const static int BookHeaderSz = 128;
         const static int BookHeaderSignature = 13579;
 
+        // Data of each side starts at a page boundary, thus the file is safe to be memory mapped
+        const static u16 PropertyAlignedData = 1 << 0;
+        const static int BookDataAlignment = 4096;
+
+        // Data of each side is an open addressing hash table instead of a sorted array. Size is then
+        // the number of slots (a power of two), empty slots have key 0
+        const static u16 PropertyHashedData = 1 << 1;
+
+        // A Bloom filter of all keys is stored after the data, filterBlocks is its size
+        const static u16 PropertyBloomFilter = 1 << 2;
+        const static int FilterAlignment = 64;
+
+        // Positions are stored under the smaller of their keys and their horizontally mirrored keys
+        const static u16 PropertyCanonicalKeys = 1 << 3;
+
         void reset() {
             memset(this, 0, sizeof(BookHeader));
             signature = BookHeaderSignature;
@@ -92,11 +109,53 @@ namespace opening {
             strncpy(textInfo, str, sizeof(textInfo));
         }
 
+        bool isAlignedData() const {
+            return (property & PropertyAlignedData) != 0;
+        }
+
+        bool isHashedData() const {
+            return (property & PropertyHashedData) != 0;
+        }
+
+        bool hasBloomFilter() const {
+            return (property & PropertyBloomFilter) != 0 && filterBlocks > 0;
+        }
+
+        bool isCanonicalKeys() const {
+            return (property & PropertyCanonicalKeys) != 0;
+        }
+
+        // Offset of data of a given side from the beginning of the file
+        i64 dataOffset(int sd) const {
+            i64 offset = BookHeaderSz;
+            if (isAlignedData()) {
+                offset = alignOffset(offset);
+            }
+            if (sd == 1) {
+                offset += size[0] * sizeof(BookItem);
+                if (isAlignedData()) {
+                    offset = alignOffset(offset);
+                }
+            }
+            return offset;
+        }
+
+        // Offset of the Bloom filter, right after data of both sides
+        i64 filterOffset() const {
+            i64 offset = dataOffset(1) + size[1] * sizeof(BookItem);
+            auto alignment = isAlignedData() ? BookDataAlignment : FilterAlignment;
+            return (offset + alignment - 1) / alignment * alignment;
+        }
+
+        static i64 alignOffset(i64 offset) {
+            return (offset + BookDataAlignment - 1) / BookDataAlignment * BookDataAlignment;
+        }
+
     public:
         // 32 bytes info
         u16 signature;
         u16 property;
-        u32 reserveVar;
+        u32 filterBlocks;
         i64 size[2];
         u8  reserve[8];
 
@@ -104,64 +163,330 @@ namespace opening {
         char textInfo[128];
     };
 
+    // In-memory static B+tree (S-tree) over the keys of a sorted BookItem array. Nodes are 64 bytes
+    // of 8 aligned keys, searched with SIMD compares when the build enables AVX2 / SSE4.2.
+    // Each key of an inner node is the largest key of a child. Leaves are all keys in their original order,
+    // thus the position of a key in the leaves is the index of its item in the book data
+    class BookSearchIndex {
+    public:
+        const static int NodeKeyNumber = 8;
+        const static int MaxLayerNumber = 24;
+
+        BookSearchIndex();
+        ~BookSearchIndex();
+
+        bool build(const BookItem* items, i64 itemCount);
+        void reset();
+
+        bool isEmpty() const {
+            return nodes == nullptr;
+        }
+
+        i64 find(u64 key) const;
+        void find(const u64* keys, i64* idxs, int n) const;
+
+    private:
+        BookSearchIndex(const BookSearchIndex&);
+        BookSearchIndex& operator = (const BookSearchIndex&);
+
+        static int countLess(const u64* node, u64 key);
+
+        void* buf;
+        u64* nodes;
+        i64 itemCount;
+        int layerCount;
+        i64 layerStarts[MaxLayerNumber]; // first node of each layer, layer 0 is the leaves
+    };
+
+    // Blocked Bloom filter: all bits of a key are in one 64-byte block, thus a key which is
+    // not in the book is rejected by reading a single cache line
+    class BookBloomFilter {
+    public:
+        const static int BlockWordNumber = 8;
+        const static int BitsPerKey = 10;
+        const static int ProbeNumber = 6;
+        const static u64 ProbeMultiplier = 0x9e3779b97f4a7c15ULL; // odd
+
+        BookBloomFilter();
+        ~BookBloomFilter();
+
+        static i64 blockNumber(i64 itemCount);
+
+        bool create(i64 blockCount);
+        void attach(const u64* data, i64 blockCount);
+        void reset();
+
+        bool isEmpty() const {
+            return blocks == nullptr;
+        }
+
+        const u64* getData() const {
+            return blocks;
+        }
+        i64 getBlockCount() const {
+            return blockCount;
+        }
+        i64 getByteSize() const {
+            return blockCount * BlockWordNumber * sizeof(u64);
+        }
+
+        void add(u64 key, int sd);
+        bool mayContain(u64 key, int sd) const;
+
+    private:
+        BookBloomFilter(const BookBloomFilter&);
+        BookBloomFilter& operator = (const BookBloomFilter&);
+
+        static u64 hash(u64 key, int sd);
+
+        void* buf; // owned memory, null when blocks point to mapped data
+        u64* blocks;
+        i64 blockCount;
+    };
+
     class OpBookCore {
     public:
         OpBookCore();
         virtual ~OpBookCore();
 
         Move probe(const std::string& fen, MoveList* opMoveList = nullptr) const;
+        Move probe(const char* fen, MoveList* opMoveList = nullptr) const;
         Move probe(const int8_t* pieceList, Side side, MoveList* opMoveList = nullptr) const;
+        Move probe(const PositionCore& position, MoveList* opMoveList = nullptr) const;
         Move probe(const MoveList& moveList, MoveList* opMoveList = nullptr) const;
         Move probe(const std::vector<Piece> pieceVec, Side side, MoveList* opMoveList = nullptr) const;
         Move probe(OpeningBoard& board, MoveList* opMoveList = nullptr) const;
 
-        bool load(const std::string& path);
+        // mmapMode: map the file read-only and probe straight on the mapped data
+        // instead of copying it into memory. The data can't be updated in that mode
+        // indexed: build the search index after loading, for probing large books faster
+        bool load(const std::string& path, bool mmapMode = false, bool indexed = false);
         bool save(std::string path = "");
 
+        bool isMapped() const {
+            return mappedFile != nullptr;
+        }
+
+        // Optional search index, it takes about 8 bytes per item and speeds up probing large books.
+        // It should be rebuilt after loading again. Books of hashed data don't need it
+        bool buildSearchIndex();
+
+        // Lookups with the index should be the same as binary searches. It searches every key, for verifying only
+        bool crossCheckSearchIndex(int sd) const;
+
+        // Bloom filter to reject quickly keys which are not in the book. It is loaded with the book
+        // when the file has one, otherwise it could be built here and it is then kept when saving
+        bool buildBloomFilter();
+        bool hasBloomFilter() const {
+            return !bloomFilter.isEmpty();
+        }
+        static bool addBloomFilter(const std::string& path);
+
+        // Change layout of loaded data between sorted arrays and hash tables, and convert book files
+        bool convertData(bool hashed);
+        static bool convert(const std::string& inPath, const std::string& outPath, bool hashed);
+
+        // Keys of positions as they are stored in the book, all lookups by positions should use them
+        u64 bookKey(const PositionCore& board) const;
+        u64 bookKeyAfterMove(const PositionCore& board, const Move& move) const;
+
         i64 find(u64 key, int sd) const;
+        void find(const u64* keys, i64* idxs, int n, int sd) const;
         u16 getValueByIndex(u64 idx, int sd) const;
 
         virtual int getValueByKey(u64 key, int sd) const;
 
+        // Look up many keys (such as all children of a position) in one pass, values are -1 for missing keys
+        virtual void getValuesByKeys(const u64* keys, int* values, int n, int sd) const;
+
         BookHeader* getHeader() {
             return &header;
         }
+        const BookHeader* getHeader() const {
+            return &header;
+        }
 
         BookItem* getData(int sd) {
             return bookData[sd];
         }
+        const BookItem* getData(int sd) const {
+            return bookData[sd];
+        }
 
         bool _updateValue(u64 key, int value, Side side);
 
+        // Copy all data into memory, such as for updating a book without touching the origin
+        bool copyData(const OpBookCore& other);
+        bool writeValue(i64 idx, int value, int sd) const;
+
     protected:
-        Move _probe(OpeningBoard& board, MoveList* opMoveList = nullptr) const;
+        Move _probe(const PositionCore& board, MoveList* opMoveList = nullptr, FlipMode flipMode = FlipMode::none) const;
         static i64 find(u64 key, const char* data, i64 itemCount, int itemSize);
-        
+        static void find(const u64* keys, i64* idxs, int n, const char* data, i64 itemCount, int itemSize);
+        void findUnfiltered(const u64* keys, i64* idxs, int n, int sd) const;
+
+        static i64 hashedCapacity(i64 itemCount);
+        static void buildHashedData(const BookItem* items, i64 itemCount, BookItem* table, i64 capacity);
+        static i64 findHashed(u64 key, const BookItem* table, i64 capacity);
+
+        bool loadData();
+        bool loadMapped();
+        void freeData();
+
+        static bool writePadding(std::ofstream& outfile, i64 offset);
+
     protected:
         BookHeader header;
         BookItem* bookData[2];
 
         i64 allocatedSizes[2];
+        MemMappedFile* mappedFile;
+        BookSearchIndex searchIndex[2];
+        BookBloomFilter bloomFilter;
 
         std::string path;
     };
 
+    // Read sections of snapshots. A writer publishes a new snapshot, then waits in synchronize()
+    // until readers which could see the old one have left, before freeing it. Readers count
+    // themselves in slots of their threads, thus they don't write to shared cache lines
+    class SnapshotDomain {
+    public:
+        const static int SlotNumber = 64;
+
+        SnapshotDomain();
+
+        int enter() const;
+        void leave(int token) const;
+        void synchronize();
+
+    private:
+        SnapshotDomain(const SnapshotDomain&);
+        SnapshotDomain& operator = (const SnapshotDomain&);
+
+        static int slotIndex();
+
+        // one slot takes a cache line
+        class Slot {
+        public:
+            std::atomic<i64> counts[2];
+            char padding[64 - 2 * sizeof(std::atomic<i64>)];
+        };
+
+        mutable Slot slots[SlotNumber];
+        std::atomic<int> epoch;
+    };
+
+    // How values of a layer are combined with those of layers under it
+    enum class BookLayerPolicy {
+        override, sum
+    };
+
+    class BookLayer {
+    public:
+        std::shared_ptr<const OpBookCore> book;
+        BookLayerPolicy policy;
+    };
+
+    // Value of a key resolved through all layers above the main data. When no layer overrides it,
+    // the value is added to the one of the main data (0 when the main data doesn't have the key)
+    class BookOverlayItem {
+    public:
+        u64 key;
+        int value;
+        bool overMain;
+
+        int apply(int mainValue) const {
+            return overMain ? MAX(mainValue, 0) + value : value;
+        }
+    };
+
+    // Keys of all layers, built at once, thus lookups don't depend on the number of layers.
+    // Most keys are not in any layer, they are rejected by the Bloom filter
+    class BookOverlay {
+    public:
+        const BookOverlayItem* find(u64 key, int sd) const;
+
+        std::vector<BookOverlayItem> items[2];
+        BookBloomFilter bloomFilter;
+    };
+
+    // Data which may be updated while probing. Snapshots are never changed once they are published
+    class OpBookSnapshot {
+    public:
+        std::shared_ptr<const OpBookCore> learntBook;
+
+        // layers above the main data, from the bottom. The learnt book is the first one
+        std::vector<BookLayer> layers;
+        std::shared_ptr<const BookOverlay> overlay;
+
+        // values updated after loading, sorted by keys. Learnt ones are also in the journal,
+        // keys of those are resolved again into overlay updates
+        std::vector<BookItem> mainUpdates[2];
+        std::vector<BookItem> learntUpdates[2];
+        std::vector<BookOverlayItem> overlayUpdates[2];
+
+        static int findUpdate(const std::vector<BookItem>& updates, u64 key);
+        static void setUpdate(std::vector<BookItem>& updates, u64 key, int value);
+
+        int getLayerValue(size_t layerIdx, u64 key, int sd) const;
+        BookOverlayItem resolve(u64 key, int sd) const;
+        bool buildOverlay();
+        void applyOverlay(const u64* keys, int* values, int n, int sd) const;
+    };
+
+    // Record of the learning journal, updates are appended to it instead of rewriting the learnt file
+    class LearntJournalRecord {
+    public:
+        u64 key;
+        u16 value;
+        u8  side;
+        u8  reserve[5];
+    };
+
+    // Probing is thread safe, also with updating values at the same time. Loading is not
     class OpBook : public OpBookCore {
     public:
         const std::string LearntFileExtension = ".xlo";
+        const std::string LearntJournalFileExtension = ".xlj";
+
+        // the journal is compacted into the learnt file when it has that many records
+        const int LearntJournalCompactingNumber = 4 * 1024;
 
         OpBook();
         virtual ~OpBook();
 
-        bool load(const std::string& path);
+        bool load(const std::string& path, bool mmapMode = false, bool indexed = false);
         bool updateValue(u64 key, int value, Side side, int saveTo);
 
+        // Write learnt values of the journal into the learnt file, then empty the journal
+        bool compactLearntData();
+
+        // Add a layer on top of the others (the learnt book is the first one), such as of a tournament
+        bool addLayer(const std::string& path, BookLayerPolicy policy, bool mmapMode = false);
+
         virtual int getValueByKey(u64 key, int sd) const;
         int getValueByKeyFromMainData(u64 key, int sd) const;
         int getValueByKeyFromLearntData(u64 key, int sd) const;
 
+        virtual void getValuesByKeys(const u64* keys, int* values, int n, int sd) const;
+        void getValuesByKeysFromMainData(const u64* keys, int* values, int n, int sd) const;
+        void getValuesByKeysFromLearntData(const u64* keys, int* values, int n, int sd) const;
+
     protected:
-        OpBookCore* learntBook;
+        void publish(OpBookSnapshot* newSnapshot);
+        bool updateMainValue(u64 key, int value, int sd);
+        bool updateLearntValue(u64 key, int value, int sd);
+        void replayLearntJournal(OpBookSnapshot* newSnapshot);
+        bool _compactLearntData();
+
+        std::atomic<OpBookSnapshot*> snapshot;
+        SnapshotDomain snapshotDomain;
+        std::mutex updateMutex;
+
+        std::string learntPath, journalPath;
+        std::ofstream journalFile;
+        int journalRecordCnt;
     };
 }
 
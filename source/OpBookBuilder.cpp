@@ -23,13 +23,19 @@
  SOFTWARE.
  */
 
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <cstdio>
+
 #include "OpBookBuilder.h"
 #include "GameReader.h"
 
 using namespace opening;
 
-void dumbReportString(std::string) {}
-void dumbReportNumbers(int fileCnt, int gameCnt, int nodeCnt, int addedNodeCnt) {}
+void opening::dumbReportString(std::string) {}
+void opening::dumbReportNumbers(int fileCnt, int gameCnt, int nodeCnt, int addedNodeCnt) {}
 
 void OpBookBuilder::create(std::map<std::string, std::string> paramMap,
                            std::function<void(std::string)> reportString,
@@ -37,7 +43,41 @@ void OpBookBuilder::create(std::map<std::string, std::string> paramMap,
                            ) {
     m_reportFileCnt = m_reportCnt = m_reportNodeCnt = 0;
 
-    auto it = paramMap.find("folder");
+    std::string bookPath;
+    auto it = paramMap.find("out");
+    if (it == paramMap.end() || it->second.empty()) {
+        bookPath = "./openingbook.xob";
+    } else {
+        bookPath = it->second;
+    }
+
+    // Memory budget in MB. Data is spilt into sorted runs in temporary files when the budget is hit
+    m_memoryBudget = 0;
+    m_pendingLimit = CreatingPendingKeyNumber;
+    m_creatingFailed = false;
+    it = paramMap.find("memory");
+    if (it != paramMap.end()) {
+        auto str = it->second;
+        i64 k = atoi(str.c_str());
+        if (k > 0) {
+            m_memoryBudget = MAX(k, (i64)CreatingMinMemoryBudget) * 1024 * 1024;
+
+            // a quarter of the budget for pending keys of both sides, a quarter for batches of parsed games
+            // (see create_batchBytes), the rest is for merging
+            m_pendingLimit = m_memoryBudget / 8 / sizeof(u64);
+            m_runPrefix = bookPath + ".run";
+        }
+    }
+
+    // hash tables are built in memory from the whole data, that would break the budget
+    if (m_memoryBudget > 0 && paramMap.find("-hashed") != paramMap.end()) {
+        std::string s = "Error: -hashed cannot be used with -memory. Build a sorted book, then convert it with -convert and -hashed";
+        std::cerr << s << std::endl;
+        reportString(s);
+        return;
+    }
+
+    it = paramMap.find("folder");
     if (it != paramMap.end()) {
         std::vector<std::string> folderVec;
         folderVec.push_back(it->second);
@@ -49,16 +89,21 @@ void OpBookBuilder::create(std::map<std::string, std::string> paramMap,
         create(it->second, paramMap, reportString, reportNumbers);
     }
 
-    std::string bookPath;
-    it = paramMap.find("out");
-    if (it == paramMap.end() || it->second.empty()) {
-        bookPath = "./openingbook.xob";
-    } else {
-        bookPath = it->second;
+    for(int sd = 0; sd < 2; sd++) {
+        create_flush(sd);
     }
 
-    if (header.size[0] + header.size[1] > 0) {
-        createSave(bookPath, paramMap);
+    // a run which couldn't be written (such as of a full disk) would make a truncated book
+    if (m_creatingFailed) {
+        createRemoveRuns();
+        std::cerr << "Error: Cannot write temporary files, the book is not created" << std::endl;
+    } else if (header.size[0] + header.size[1] > 0) {
+        auto ok = m_memoryBudget > 0 ? createSaveRuns(bookPath, paramMap) : createSave(bookPath, paramMap);
+
+        // the filter is built from the saved file, it works for both in-memory and run builds
+        if (ok && paramMap.find("-bloom") != paramMap.end() && !addBloomFilter(bookPath) && openingVerbose) {
+            std::cerr << "Error: cannot add Bloom filter to " << bookPath << std::endl;
+        }
     } else if (openingVerbose) {
         std::cerr << "Error: book is empty" << std::endl;
     }
@@ -67,26 +112,120 @@ void OpBookBuilder::create(std::map<std::string, std::string> paramMap,
 
 void OpBookBuilder::create(const std::vector<std::string>& folderVec, const std::map<std::string, std::string>& paramMap, std::function<void(std::string)> reportString, std::function<void(int, int, int, int)> reportNumbers)
 {
+    std::vector<std::string> pathVec;
     for(auto && folder : folderVec) {
-        std::vector<std::string> pathVec = listdir(folder);
+        auto vec = listdir(folder);
+        pathVec.insert(pathVec.end(), vec.begin(), vec.end());
+    }
+
+    int threadCnt = 1;
+    auto it = paramMap.find("threads");
+    if (it != paramMap.end()) {
+        auto str = it->second;
+        int k = atoi(str.c_str());
+        if (k > 0) {
+            threadCnt = k;
+        }
+    }
+
+    if (threadCnt <= 1 || pathVec.size() <= 1) {
         for(auto && path : pathVec) {
             create(path, paramMap, reportString, reportNumbers);
         }
+        return;
+    }
+
+    // Workers parse files, one file by a worker, and extract keys in parallel. Batches are added to the book
+    // in the order of files, the same order as a single thread does, since flipping decisions depend on previous
+    // games. A worker waits while its file has a batch not added yet, thus each worker has at most two batches
+    // in memory (one waiting, one being parsed) and the adding one more
+    auto batchBytes = create_batchBytes(2 * threadCnt + 1);
+    std::vector<std::queue<CreatingBatch>> batchQueues(pathVec.size());
+    size_t nextIdx = 0;
+
+    std::mutex mutex;
+    std::condition_variable condition;
+
+    auto worker = [&]() {
+        while (true) {
+            size_t idx;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (nextIdx >= pathVec.size()) {
+                    return;
+                }
+                idx = nextIdx++;
+            }
+
+            GameReader gameReader(pathVec.at(idx), true);
+            for(bool first = true, last = false; !last; first = false) {
+                CreatingBatch batch;
+                batch.first = first;
+                create_parse(gameReader, pathVec.at(idx), paramMap, batch, batchBytes);
+                last = batch.last;
+
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [&]() { return batchQueues[idx].empty(); });
+                batchQueues[idx].push(std::move(batch));
+                condition.notify_all();
+            }
+        }
+    };
+
+    std::vector<std::thread> threadVec;
+    for(int i = 0; i < threadCnt; i++) {
+        threadVec.push_back(std::thread(worker));
+    }
+
+    for(size_t idx = 0; idx < pathVec.size(); idx++) {
+        for(bool last = false; !last; ) {
+            CreatingBatch batch;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [&]() { return !batchQueues[idx].empty(); });
+                batch = std::move(batchQueues[idx].front());
+                batchQueues[idx].pop();
+                condition.notify_all();
+            }
+
+            last = batch.last;
+            create_add(pathVec.at(idx), batch, paramMap, reportString, reportNumbers);
+        }
+    }
+
+    for(auto && thread : threadVec) {
+        thread.join();
     }
 }
 
 void OpBookBuilder::create(const std::string& inputPath, const std::map<std::string, std::string>& paramMap, std::function<void(std::string)> reportString, std::function<void(int, int, int, int)> reportNumbers)
 {
-    if (openingVerbose) {
-        std::cout << "\tgame: " << inputPath << std::endl;
+    GameReader gameReader(inputPath, true);
+    auto batchBytes = create_batchBytes(1);
+
+    for(bool first = true, last = false; !last; first = false) {
+        CreatingBatch batch;
+        batch.first = first;
+        create_parse(gameReader, inputPath, paramMap, batch, batchBytes);
+        last = batch.last;
+        create_add(inputPath, batch, paramMap, reportString, reportNumbers);
     }
+}
 
-    reportString(inputPath);
-
-    m_reportFileCnt++;
-
-    GameReader gameReader(inputPath);
+// Memory for keys of parsed games: without a budget a batch has about CreatingBatchKeyNumber keys,
+// with a budget all batches in memory at the same time share a quarter of it
+i64 OpBookBuilder::create_batchBytes(int batchCnt) const
+{
+    if (m_memoryBudget <= 0) {
+        return CreatingBatchKeyNumber * (i64)sizeof(u64);
+    }
+    return MAX(CreatingMinBatchBytes, m_memoryBudget / 4 / batchCnt);
+}
 
+// Read games of a file and collect their keys to add, until the batch is over maxBytes or the file ends (last).
+// It doesn't touch the book, thus it can run in parallel
+void OpBookBuilder::create_parse(GameReader& gameReader, const std::string& inputPath, const std::map<std::string, std::string>& paramMap, CreatingBatch& batch, i64 maxBytes) const
+{
     int maxply = Para_DefaultAddToPly;
     auto it = paramMap.find("maxply");
     if (it != paramMap.end()) {
@@ -107,31 +246,18 @@ void OpBookBuilder::create(const std::string& inputPath, const std::map<std::str
         }
     }
 
-    // Side
-    const int White = 1;
-    const int Black = 1 << 1;
-
-    int forSide = White | Black;
-
-    if (paramMap.find("-only-white") != paramMap.end()) {
-        forSide = White;
-    } else if (paramMap.find("-only-black") != paramMap.end()) {
-        forSide = Black;
-    }
-
-    if (forSide & White) {
-        createInit(Side::white);
-    }
-    if (forSide & Black) {
-        createInit(Side::black);
-    }
+    int forSide = create_forSide(paramMap);
 
     // Add games
     OpeningBoard board;
-    while(gameReader.nextGame(board)) {
-        m_reportCnt++;
+    while(batch.byteCnt < maxBytes) {
+        if (!gameReader.nextGame(board)) {
+            batch.last = true;
+            break;
+        }
+        batch.gameCnt++;
 
-        if (board.getHistList().size() < minply) {
+        if (board.getPly() < minply) {
             if (openingVerbose) {
                 std::cerr << "\t\tignore game " << inputPath << ", idx: " << gameReader.currentGameIdx() << " - game too short" << std::endl;
             }
@@ -141,11 +267,11 @@ void OpBookBuilder::create(const std::string& inputPath, const std::map<std::str
         Side workingSide = Side::none;
 
         if (board.getResult().result == ResultType::win) {
-            if (forSide & White) {
+            if (forSide & CreatingWhite) {
                 workingSide = Side::white;
             }
         } else if (board.getResult().result == ResultType::loss) {
-            if (forSide & Black) {
+            if (forSide & CreatingBlack) {
                 workingSide = Side::black;
             }
         }
@@ -158,11 +284,11 @@ void OpBookBuilder::create(const std::string& inputPath, const std::map<std::str
         }
 
         std::vector<Move> moves;
-        for(auto && hist : board.getHistList()) {
-            moves.push_back(hist.move);
+        for(auto && undo : board.getUndoList()) {
+            moves.push_back(undo.move);
         }
 
-        while (!board.getHistList().empty()) {
+        while (board.getPly() > 0) {
             board.takeBack();
         }
 
@@ -173,131 +299,517 @@ void OpBookBuilder::create(const std::string& inputPath, const std::map<std::str
             continue;
         }
 
-        create_checkFlipping(board, moves, workingSide);
+        CreatingGame game;
+        game.workingSide = workingSide;
 
-        if (board.side != workingSide) {
-            create_add(board);
-        }
+        create_collectKeys(board, moves, workingSide, maxply, game);
 
-        m_keyMap.clear();
-        for(int ply = 0; ply < (int)moves.size() && ply < maxply; ply++) {
-            auto move = moves.at(ply);
-            board.make(move);
+        batch.byteCnt += (i64)sizeof(CreatingGame) + (i64)(game.keys[0].capacity() + game.keys[1].capacity()) * (i64)sizeof(u64);
+        batch.gameVec.push_back(std::move(game));
+    }
+}
 
-            // Any repitition will be terminated
-            auto key = board.key();
-            if (m_keyMap.find(key) != m_keyMap.end()) {
-                break;
-            }
-            m_keyMap[key] = key;
-            if (board.side != workingSide) {
-                create_add(board);
-            }
+// Keys as the game has been played and as it is flipped horizontally, both come from the same moves
+void OpBookBuilder::create_collectKeys(OpeningBoard& board, const std::vector<Move>& moves, Side workingSide, int maxply, CreatingGame& game) const
+{
+    // The key for checking flipping
+    auto madeFirst = board.side == workingSide;
+    int8_t cap = 0;
+    if (madeFirst) {
+        cap = board.PositionCore::make(moves.front());
+    }
+
+    game.rootKeys[0] = board.key();
+    game.rootKeys[1] = board.key(FlipMode::horizontal);
+
+    if (madeFirst) {
+        board.PositionCore::takeBack(moves.front(), cap);
+    }
+
+    if (board.side != workingSide) {
+        game.keys[0].push_back(board.key());
+        game.keys[1].push_back(board.key(FlipMode::horizontal));
+    }
+
+    std::map<u64, u64> keyMap;
+    for(int ply = 0; ply < (int)moves.size() && ply < maxply; ply++) {
+        auto move = moves.at(ply);
+        board.make(move);
+
+        // Any repitition will be terminated
+        auto key = board.key();
+        if (keyMap.find(key) != keyMap.end()) {
+            break;
+        }
+        keyMap[key] = key;
+        if (board.side != workingSide) {
+            game.keys[0].push_back(key);
+            game.keys[1].push_back(board.key(FlipMode::horizontal));
         }
     }
 
-    reportNumbers(m_reportFileCnt, m_reportCnt, m_reportNodeCnt, header.size[0] + header.size[1]);
+    while (board.getPly() > 0) {
+        board.takeBack();
+    }
 }
 
-void OpBookBuilder::create_checkFlipping(opening::OpeningBoard& board, std::vector<opening::Move>& moves, opening::Side workingSide)
+void OpBookBuilder::create_add(const std::string& inputPath, const CreatingBatch& batch, const std::map<std::string, std::string>& paramMap, std::function<void(std::string)> reportString, std::function<void(int, int, int, int)> reportNumbers)
 {
-    bool needHorizontalFlip = false;
-    Hist hist;
-    hist.hashKey = 0;
-    if (board.side == workingSide) {
-        board.make(moves.front(), hist);
+    if (batch.first) {
+        if (openingVerbose) {
+            std::cout << "\tgame: " << inputPath << std::endl;
+        }
+
+        reportString(inputPath);
+        m_reportFileCnt++;
     }
 
-    auto sd = static_cast<int>(workingSide);
-    auto idx = find(board.key(), sd);
+    m_reportCnt += batch.gameCnt;
 
-    if (idx < 0) {
-        board.flip(opening::FlipMode::horizontal);
-        needHorizontalFlip = find(board.key(), sd) >= 0;
-        board.flip(opening::FlipMode::horizontal);
+    int forSide = create_forSide(paramMap);
+    if (forSide & CreatingWhite) {
+        createInit(Side::white);
     }
-
-    if (hist.hashKey != 0) {
-        board.takeBack(hist);
+    if (forSide & CreatingBlack) {
+        createInit(Side::black);
     }
 
-    if (needHorizontalFlip) {
-        board.flip(opening::FlipMode::horizontal);
-        for(auto && move : moves) {
-            move.from = OpeningBoard::flip(move.from, opening::FlipMode::horizontal);
-            move.dest = OpeningBoard::flip(move.dest, opening::FlipMode::horizontal);
+    auto canonical = paramMap.find("-canonical") != paramMap.end();
+
+    for(auto && game : batch.gameVec) {
+        auto sd = static_cast<int>(game.workingSide);
+
+        // Keys of the game and of its flipped one are of the same positions, the smaller ones are stored
+        if (canonical) {
+            assert(game.keys[0].size() == game.keys[1].size());
+            for(size_t i = 0; i < game.keys[0].size(); i++) {
+                create_add(MIN(game.keys[0][i], game.keys[1][i]), sd);
+            }
+            continue;
         }
 
-        assert(!board.getPiece(moves.front().from).isEmpty());
+        // Flip the game horizontally if only its flipped one is already in the book
+        int flipped = !create_findRoot(game.rootKeys[0], sd) && create_findRoot(game.rootKeys[1], sd) ? 1 : 0;
+
+        for(auto && key : game.keys[flipped]) {
+            create_add(key, sd);
+        }
     }
+
+    reportNumbers(m_reportFileCnt, m_reportCnt, m_reportNodeCnt, (int)(header.size[0] + header.size[1] + m_pendingKeys[0].size() + m_pendingKeys[1].size()));
+}
+
+int OpBookBuilder::create_forSide(const std::map<std::string, std::string>& paramMap)
+{
+    if (paramMap.find("-only-white") != paramMap.end()) {
+        return CreatingWhite;
+    }
+    if (paramMap.find("-only-black") != paramMap.end()) {
+        return CreatingBlack;
+    }
+    return CreatingWhite | CreatingBlack;
 }
 
 void OpBookBuilder::createInit(opening::Side side) {
     int sd = static_cast<int>(side);
 
-    if (bookData[sd]) {
+    // done once, pending keys keep their room after that
+    if (m_pendingKeys[sd].capacity() > 0) {
         return;
     }
 
     header.reset();
 
-    allocatedSizes[sd] = CreatingAdditionalItemNumber;
-    bookData[sd] = (BookItem*)malloc(allocatedSizes[sd] * sizeof(BookItem) + 32);
+    // data is merged in memory without a budget, with a budget it is only in runs and pending keys
+    if (m_memoryBudget <= 0) {
+        allocatedSizes[sd] = CreatingAdditionalItemNumber;
+        bookData[sd] = (BookItem*)malloc(allocatedSizes[sd] * sizeof(BookItem) + 32);
+    }
+
+    m_pendingKeys[sd].reserve(m_pendingLimit);
+
+    if (m_rootCandidateKeys.empty()) {
+        createRootCandidates();
+    }
 }
 
-bool OpBookBuilder::create_add(const opening::OpeningBoard& board)
+// Flipping decisions look up only the origin and positions one ply from it (see create_collectKeys).
+// Those keys are collected, when added, into small sets, so the decisions don't need the main data
+// which is not sorted nor merged until the end
+void OpBookBuilder::createRootCandidates()
 {
-    auto key = board.key();
-    int sd = 1 - static_cast<int>(board.side);
+    OpeningBoard board;
+    board.setFen("");
 
-    if (header.size[sd] == 0) {
-        bookData[sd][0].incValue(key);
-        header.size[sd]++;
-        return true;
+    m_rootCandidateKeys.push_back(board.key());
+
+    for(int sd = 0; sd < 2; sd++) {
+        auto side = static_cast<Side>(sd);
+        MoveList moveList;
+        board.genLegal(moveList, side);
+
+        for(int i = 0; i < moveList.end; i++) {
+            auto cap = board.PositionCore::make(moveList.list[i]);
+            m_rootCandidateKeys.push_back(board.key());
+            board.PositionCore::takeBack(moveList.list[i], cap);
+        }
+    }
+
+    std::sort(m_rootCandidateKeys.begin(), m_rootCandidateKeys.end());
+}
+
+bool OpBookBuilder::create_findRoot(u64 key, int sd) const
+{
+    assert(std::binary_search(m_rootCandidateKeys.begin(), m_rootCandidateKeys.end(), key));
+    return m_rootKeys[sd].find(key) != m_rootKeys[sd].end();
+}
+
+bool OpBookBuilder::create_add(u64 key, int sd)
+{
+    if (m_creatingFailed) {
+        return false;
     }
 
     m_reportNodeCnt++;
 
-    i64 idx = 0;
-    i64 i = 0, j = header.size[sd] - 1;
+    if (std::binary_search(m_rootCandidateKeys.begin(), m_rootCandidateKeys.end(), key)) {
+        m_rootKeys[sd].insert(key);
+    }
 
-    while (i <= j) {
-        idx = (i + j) / 2;
-        if (key == bookData[sd][idx].key()) {
-            bookData[sd][idx].incValue(key);
-            return true;
+    m_pendingKeys[sd].push_back(key);
+    if ((i64)m_pendingKeys[sd].size() >= m_pendingLimit) {
+        create_flush(sd);
+    }
+
+    return true;
+}
+
+// Sort pending keys, count them and merge the result into the sorted data of the side.
+// Values are counted in u16 as the book items do
+void OpBookBuilder::create_flush(int sd)
+{
+    auto& keys = m_pendingKeys[sd];
+    if (keys.empty()) {
+        return;
+    }
+
+    if (m_memoryBudget > 0) {
+        create_spill(sd);
+        return;
+    }
+
+    std::sort(keys.begin(), keys.end());
+
+    i64 oldSize = header.size[sd];
+    i64 maxSize = oldSize + (i64)keys.size();
+    if (maxSize > allocatedSizes[sd] || bookData[sd] == nullptr) {
+        allocatedSizes[sd] = maxSize + CreatingAdditionalItemNumber;
+    }
+
+    auto oldData = bookData[sd];
+    auto newData = (BookItem*)malloc(allocatedSizes[sd] * sizeof(BookItem) + 32);
+
+    i64 i = 0, n = 0;
+    for(size_t j = 0; j < keys.size(); ) {
+        auto key = keys[j];
+        for(; i < oldSize && oldData[i].key() < key; i++, n++) {
+            newData[n] = oldData[i];
+        }
+
+        u16 value = 0;
+        if (i < oldSize && oldData[i].key() == key) {
+            value = oldData[i].value;
+            i++;
         }
-        if (key < bookData[sd][idx].key()) j = idx - 1;
-        else i = idx + 1;
+        for(; j < keys.size() && keys[j] == key; j++) {
+            value++;
+        }
+
+        newData[n].set(key, value);
+        n++;
     }
 
-    if (key >= bookData[sd][idx].key()) {
-        idx++;
+    for(; i < oldSize; i++, n++) {
+        newData[n] = oldData[i];
     }
 
-    if (header.size[sd] + 1 >= allocatedSizes[sd]) {
-        allocatedSizes[sd] += CreatingAdditionalItemNumber;
-        auto tmpBuf = bookData[sd];
-        bookData[sd] = (BookItem*)malloc(allocatedSizes[sd] * sizeof(BookItem) + 32);
+    if (oldData) {
+        free(oldData);
+    }
+    bookData[sd] = newData;
+    header.size[sd] = n;
+
+    keys.clear();
+}
+
+// Sort and count pending keys, then write them as a run of BookItems into a temporary file.
+// When it fails the build stops (m_creatingFailed), the run is not used
+bool OpBookBuilder::create_spill(int sd)
+{
+    auto& keys = m_pendingKeys[sd];
+    if (m_creatingFailed) {
+        keys.clear();
+        return false;
+    }
+
+    std::sort(keys.begin(), keys.end());
+
+    std::ostringstream stringStream;
+    stringStream << m_runPrefix << sd << "-" << m_runPaths[sd].size();
+    auto runPath = stringStream.str();
+
+    std::ofstream outfile(runPath, std::ios::binary);
+
+    std::vector<BookItem> buf(CreatingIOItemNumber);
+    i64 itemCnt = 0;
+    size_t n = 0;
+    for(size_t j = 0; j < keys.size() && outfile; ) {
+        auto key = keys[j];
+        u16 value = 0;
+        for(; j < keys.size() && keys[j] == key; j++) {
+            value++;
+        }
+
+        buf[n++].set(key, value);
+        if (n == buf.size() || j == keys.size()) {
+            outfile.write((const char*)buf.data(), n * sizeof(BookItem));
+            itemCnt += n;
+            n = 0;
+        }
+    }
+
+    outfile.close();
+    keys.clear();
+
+    if (!outfile) {
+        std::cerr << "Error: Cannot write temporary file " << runPath << std::endl;
+        std::remove(runPath.c_str());
+        m_creatingFailed = true;
+        return false;
+    }
+
+    m_runPaths[sd].push_back(runPath);
+
+    // upper bound, the same keys may be in several runs
+    header.size[sd] += itemCnt;
+    return true;
+}
+
+namespace opening {
+    class BookRunReader {
+    public:
+        BookRunReader(const std::string& path, size_t bufSize)
+            : file(path, std::ios::binary), buf(bufSize), pos(0), cnt(0)
+        {
+            fill();
+        }
+
+        bool isEmpty() const {
+            return pos >= cnt;
+        }
+
+        const BookItem& current() const {
+            return buf[pos];
+        }
+
+        void next() {
+            if (++pos >= cnt) {
+                fill();
+            }
+        }
+
+    private:
+        void fill() {
+            file.read((char*)buf.data(), buf.size() * sizeof(BookItem));
+            cnt = (size_t)file.gcount() / sizeof(BookItem);
+            pos = 0;
+        }
+
+        std::ifstream file;
+        std::vector<BookItem> buf;
+        size_t pos, cnt;
+    };
+}
+
+// k-way merge of sorted runs into a stream. Values of the same key are summed up in u16 as the book items do.
+// Items with values less than minValue are dropped. Return the number of written items or -1 for errors
+i64 OpBookBuilder::create_mergeRuns(const std::vector<std::string>& runPaths, std::ofstream& outfile, int minValue) const
+{
+    auto bufSize = (size_t)MAX((i64)1024, m_memoryBudget / 2 / (i64)(runPaths.size() + 1) / (i64)sizeof(BookItem));
+
+    std::vector<BookRunReader*> readers;
+    for(auto && runPath : runPaths) {
+        readers.push_back(new BookRunReader(runPath, bufSize));
+    }
+
+    // min-heap of (key, reader index)
+    typedef std::pair<u64, size_t> HeapItem;
+    std::priority_queue<HeapItem, std::vector<HeapItem>, std::greater<HeapItem>> heap;
+    for(size_t i = 0; i < readers.size(); i++) {
+        if (!readers[i]->isEmpty()) {
+            heap.push(HeapItem(readers[i]->current().key(), i));
+        }
+    }
+
+    std::vector<BookItem> outBuf(bufSize);
+    size_t n = 0;
+    i64 itemCnt = 0;
+
+    while (!heap.empty() && outfile) {
+        auto key = heap.top().first;
+        u16 value = 0;
+
+        while (!heap.empty() && heap.top().first == key) {
+            auto reader = readers[heap.top().second];
+            auto i = heap.top().second;
+            heap.pop();
+
+            value += reader->current().value;
+            reader->next();
+            if (!reader->isEmpty()) {
+                heap.push(HeapItem(reader->current().key(), i));
+            }
+        }
 
-        i64 i = 0;
-        for(; i < idx; i++) {
-            bookData[sd][i] = tmpBuf[i];
+        if (value >= minValue) {
+            outBuf[n++].set(key, value);
+            itemCnt++;
+            if (n == outBuf.size()) {
+                outfile.write((const char*)outBuf.data(), n * sizeof(BookItem));
+                n = 0;
+            }
         }
-        for(; i < header.size[sd]; i++) {
-            bookData[sd][i + 1] = tmpBuf[i];
+    }
+
+    if (n > 0) {
+        outfile.write((const char*)outBuf.data(), n * sizeof(BookItem));
+    }
+
+    for(auto && reader : readers) {
+        delete reader;
+    }
+
+    return outfile ? itemCnt : -1;
+}
+
+void OpBookBuilder::createRemoveRuns()
+{
+    for(int sd = 0; sd < 2; sd++) {
+        for(auto && runPath : m_runPaths[sd]) {
+            std::remove(runPath.c_str());
         }
-        free(tmpBuf);
+        m_runPaths[sd].clear();
+    }
+}
+
+bool OpBookBuilder::createSaveRuns(const std::string& path_, const std::map<std::string, std::string>& paramMap)
+{
+    path = path_;
+
+    // Too many runs are merged in some passes, limiting the number of opened files and the memory for buffers
+    bool ok = true;
+    for(int sd = 0; sd < 2 && ok; sd++) {
+        auto& runPaths = m_runPaths[sd];
+        for(int pass = 0; runPaths.size() > CreatingMaxMergeRuns && ok; pass++) {
+            std::vector<std::string> vec;
+            for(size_t i = 0; i < runPaths.size() && ok; i += CreatingMaxMergeRuns) {
+                std::vector<std::string> group(runPaths.begin() + i, runPaths.begin() + MIN(i + CreatingMaxMergeRuns, runPaths.size()));
+
+                std::ostringstream stringStream;
+                stringStream << m_runPrefix << sd << "-p" << pass << "-" << vec.size();
+                auto runPath = stringStream.str();
+
+                std::ofstream outfile(runPath, std::ios::binary);
+                ok = create_mergeRuns(group, outfile, 0) >= 0;
+                outfile.close();
+
+                for(auto && p : group) {
+                    std::remove(p.c_str());
+                }
+                vec.push_back(runPath);
+            }
+            runPaths = vec;
+        }
+    }
+
+    std::ofstream outfile (path_, std::ios::binary);
+
+    i64 startSize[2] = { header.size[0], header.size[1] };
+
+    createHeader(paramMap);
+
+    if (!ok || !header.saveFile(outfile)) {
+        ok = false;
     } else {
-        for(i64 i = header.size[sd]; i > idx; i--) {
-            bookData[sd][i] = bookData[sd][i - 1];
+        int maxgame = createMinGame(paramMap);
+
+        for(int sd = 0; sd < 2 && ok; sd++) {
+            header.size[sd] = 0;
+            if (m_runPaths[sd].empty()) {
+                continue;
+            }
+
+            if (!writePadding(outfile, header.dataOffset(sd))) {
+                ok = false;
+                break;
+            }
+
+            auto itemCnt = create_mergeRuns(m_runPaths[sd], outfile, maxgame);
+            if (itemCnt < 0) {
+                ok = false;
+                break;
+            }
+            header.size[sd] = itemCnt;
+        }
+
+        if (ok) {
+            ok = header.saveFile(outfile);
         }
     }
 
-    header.size[sd]++;
-    bookData[sd][idx].incValue(key);
+    outfile.close();
 
-    return true;
+    createRemoveRuns();
+
+    if (openingVerbose) {
+        if (ok) {
+            std::cout << "Book has been created, #items: " << header.size[0] << ", " << header.size[1] << ", starting: " << startSize[0] << ", " << startSize[1] << std::endl;
+        } else {
+            std::cerr << "Error: Cannot write book data." << std::endl;
+        }
+    }
+
+    return ok;
+}
+
+void OpBookBuilder::createHeader(const std::map<std::string, std::string>& paramMap)
+{
+    auto it = paramMap.find("info");
+    if (it != paramMap.end()) {
+        auto str = it->second;
+        header.setNote(str.c_str());
+    }
+
+    if (paramMap.find("-aligned") != paramMap.end()) {
+        header.property |= BookHeader::PropertyAlignedData;
+    }
+    if (paramMap.find("-canonical") != paramMap.end()) {
+        header.property |= BookHeader::PropertyCanonicalKeys;
+    }
+}
+
+int OpBookBuilder::createMinGame(const std::map<std::string, std::string>& paramMap) const
+{
+    int maxgame = Para_DefaultMinGame;
+    auto it = paramMap.find("mingame");
+    if (it != paramMap.end()) {
+        auto str = it->second;
+        int k = atoi(str.c_str());
+        if (k >= 0) {
+            maxgame = k;
+        }
+    }
+    return maxgame;
 }
 
 bool OpBookBuilder::createSave(const std::string& path_, const std::map<std::string, std::string>& paramMap) {
@@ -313,29 +825,33 @@ bool OpBookBuilder::createSave(const std::string& path_, const std::map<std::str
     bool ok = true;
 
     // Header
-    auto it = paramMap.find("info");
-    if (it != paramMap.end()) {
-        auto str = it->second;
-        header.setNote(str.c_str());
+    createHeader(paramMap);
+    int maxgame = createMinGame(paramMap);
+
+    // Items are filtered before building hash tables
+    if (paramMap.find("-hashed") != paramMap.end()) {
+        for(int sd = 0; sd < 2; sd++) {
+            i64 itemCnt = 0;
+            for(i64 i = 0; i < header.size[sd]; i++) {
+                if (bookData[sd][i].value >= maxgame) {
+                    bookData[sd][itemCnt++] = bookData[sd][i];
+                }
+            }
+            header.size[sd] = itemCnt;
+        }
+        maxgame = 0;
+        convertData(true);
     }
 
     if (!header.saveFile(outfile)) {
         ok = false;
     } else {
-        int maxgame = Para_DefaultMinGame;
-        auto it = paramMap.find("mingame");
-        if (it != paramMap.end()) {
-            auto str = it->second;
-            int k = atoi(str.c_str());
-            if (k >= 0) {
-                maxgame = k;
-            }
-        }
 
         if (maxgame <= 0) {
             for(int sd = 0; sd < 2 && ok; sd++) {
                 if (header.size[sd] > 0) {
-                    if (!outfile.write((const char*)bookData[sd], header.size[sd] * sizeof(BookItem))) {
+                    if (!writePadding(outfile, header.dataOffset(sd)) ||
+                        !outfile.write((const char*)bookData[sd], header.size[sd] * sizeof(BookItem))) {
                         ok = false;
                         break;
                     }
@@ -346,6 +862,12 @@ bool OpBookBuilder::createSave(const std::string& path_, const std::map<std::str
             BookItem* tmpBuf = (BookItem*)malloc(n * sizeof(BookItem) + 16);
 
             for(int sd = 0; sd < 2 && ok; sd++) {
+                // size of the previous side has been finalised, thus the offset is known
+                if (!writePadding(outfile, header.dataOffset(sd))) {
+                    ok = false;
+                    break;
+                }
+
                 i64 itemCnt = 0;
                 for(int i = 0; i < header.size[sd]; i += n) {
                     auto *p = tmpBuf;
@@ -404,7 +926,8 @@ void OpBookBuilder::verify(std::map<std::string, std::string> paramMap,
 
     OpBookCore book;
 
-    if (!book.load(bookPath)) {
+    // indexed, lookups with the index are checked too
+    if (!book.load(bookPath, false, true)) {
         reportString("Error: Cannot load the opening book!");
         return;
     }
@@ -431,10 +954,15 @@ bool OpBookBuilder::verify(OpBookCore& book, int sd, std::function<void(std::str
 
     reportString("Checking data for " + sideString);
 
+    auto hashed = book.getHeader()->isHashedData();
+
     u16 maxVal = 0;
     for (i64 idx = 0, prevKey = 0; idx < book.getHeader()->size[sd]; idx++) {
         auto p = book.getData(sd) + idx;
-        if (prevKey >= p->key() || p->value == 0) {
+        if (hashed && p->key() == 0) {
+            continue;
+        }
+        if ((!hashed && prevKey >= p->key()) || p->value == 0) {
             std::string s = "Error: data is incorrectly sorted";
             std::cerr << s << std::endl;
             reportString(s);
@@ -445,6 +973,13 @@ bool OpBookBuilder::verify(OpBookCore& book, int sd, std::function<void(std::str
         maxVal = std::max(maxVal, p->value);
     }
 
+    if (!book.crossCheckSearchIndex(sd)) {
+        std::string s = "Error: search index lookups differ from binary searches";
+        std::cerr << s << std::endl;
+        reportString(s);
+        return false;
+    }
+
     std::cout << "verifyData, maxVal = " << maxVal << std::endl;
 
     OpeningBoard board;
@@ -475,7 +1010,7 @@ bool OpBookBuilder::verify(OpBookCore& book, OpeningBoard& board, int sd, int pl
     auto side = board.side;
     auto sameSide = static_cast<int>(side) == sd;
     if (!sameSide) {
-        auto idx = book.find(board.key(), sd);
+        auto idx = book.find(book.bookKey(board), sd);
         if (idx < 0) {
             return false;
         }
@@ -498,7 +1033,7 @@ bool OpBookBuilder::verify(OpBookCore& book, OpeningBoard& board, int sd, int pl
     }
 
     MoveList moveList;
-    board.gen(moveList, side);
+    board.genLegal(moveList, side);
 
     for(int i = 0; i < moveList.end; i++) {
         auto move = moveList.list[i];
@@ -507,11 +1042,9 @@ bool OpBookBuilder::verify(OpBookCore& book, OpeningBoard& board, int sd, int pl
 //            std::cout << "verifyData, m_reportNodeCnt = " << m_reportNodeCnt << std::endl;
 //            board.show("after making a move, ply = 0");
 //        }
-        if (!board.isIncheck(side)) {
-            if (verify(book, board, sd, ply + 1, reportNumbers)) {
-                if (ply == 0) {
-                    reportNumbers(m_reportFileCnt, m_reportCnt, m_reportNodeCnt, book.getHeader()->size[0] + book.getHeader()->size[1]);
-                }
+        if (verify(book, board, sd, ply + 1, reportNumbers)) {
+            if (ply == 0) {
+                reportNumbers(m_reportFileCnt, m_reportCnt, m_reportNodeCnt, book.getHeader()->size[0] + book.getHeader()->size[1]);
             }
         }
         board.takeBack();
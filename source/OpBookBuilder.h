@@ -26,10 +26,14 @@
 #ifndef OpBookBuilder_hpp
 #define OpBookBuilder_hpp
 
+#include <set>
+#include <functional>
+
 #include "OpBook.h"
 
 namespace opening {
-#include <functional>
+
+    class GameReader;
 
 extern void dumbReportString(std::string msg);
 extern void dumbReportNumbers(int fileCnt, int gameCnt, int nodeCnt, int addedNodeCnt);
@@ -38,24 +42,66 @@ extern void dumbReportNumbers(int fileCnt, int gameCnt, int nodeCnt, int addedNo
     {
     private:
         const int CreatingAdditionalItemNumber = 1024 * 1024;
+        const int CreatingPendingKeyNumber = 4 * 1024 * 1024;
+        const int CreatingMinMemoryBudget = 16; // MB
+        const int CreatingIOItemNumber = 64 * 1024;
+        const int CreatingBatchKeyNumber = 1024 * 1024;
+        const i64 CreatingMinBatchBytes = 64 * 1024;
+        const size_t CreatingMaxMergeRuns = 64;
         const int Para_DefaultMinGame = 1;
         const int Para_DefaultMinGameLength = 20;
         const int Para_DefaultAddToPly = 20;
 
+        static const int CreatingWhite = 1;
+        static const int CreatingBlack = 1 << 1;
+
+        // keys of a game, as it has been played and as it is flipped horizontally
+        class CreatingGame {
+        public:
+            Side workingSide;
+            u64 rootKeys[2];
+            std::vector<u64> keys[2];
+        };
+
+        // games of a file are parsed and added in batches of bounded memory, never a whole file at once
+        class CreatingBatch {
+        public:
+            CreatingBatch() : gameCnt(0), byteCnt(0), first(false), last(false) {}
+
+            std::vector<CreatingGame> gameVec;
+            int gameCnt;
+            i64 byteCnt;
+            bool first, last;
+        };
+
     public:
         void create(std::map<std::string, std::string> paramMap, std::function<void(std::string)> reportString = &dumbReportString, std::function<void(int, int, int, int)> reportNumbers = &dumbReportNumbers);
         void verify(std::map<std::string, std::string> paramMap, std::function<void(std::string)> reportString = &dumbReportString, std::function<void(int, int, int, int)> reportNumbers = &dumbReportNumbers);
 
     private:
-        void create_checkFlipping(OpeningBoard& board, std::vector<Move>& moves, Side workingSide);
-
-        bool create_add(const OpeningBoard& board);
+        void create_parse(GameReader& gameReader, const std::string& inputPath, const std::map<std::string, std::string>& paramMap, CreatingBatch& batch, i64 maxBytes) const;
+        i64 create_batchBytes(int batchCnt) const;
+        void create_collectKeys(OpeningBoard& board, const std::vector<Move>& moves, Side workingSide, int maxply, CreatingGame& game) const;
+        void create_add(const std::string& inputPath, const CreatingBatch& batch, const std::map<std::string, std::string>& paramMap,
+                        std::function<void(std::string)> reportString, std::function<void(int, int, int, int)> reportNumbers);
+        static int create_forSide(const std::map<std::string, std::string>& paramMap);
+
+        bool create_add(u64 key, int sd);
+        void create_flush(int sd);
+        bool create_spill(int sd);
+        i64 create_mergeRuns(const std::vector<std::string>& runPaths, std::ofstream& outfile, int minValue) const;
+        bool create_findRoot(u64 key, int sd) const;
+        void createRootCandidates();
 
         void create(const std::vector<std::string>& folderVec, const std::map<std::string, std::string>& paramMap, std::function<void(std::string)> reportString, std::function<void(int, int, int, int)> reportNumbers);
         void create(const std::string& inputPath, const std::map<std::string, std::string>& paramMap,
                     std::function<void(std::string)> reportString, std::function<void(int, int, int, int)> reportNumbers);
 
         bool createSave(const std::string& path_, const std::map<std::string, std::string>& paramMap);
+        bool createSaveRuns(const std::string& path_, const std::map<std::string, std::string>& paramMap);
+        void createRemoveRuns();
+        void createHeader(const std::map<std::string, std::string>& paramMap);
+        int createMinGame(const std::map<std::string, std::string>& paramMap) const;
         void createInit(Side side);
 
     private:
@@ -63,7 +109,18 @@ extern void dumbReportNumbers(int fileCnt, int gameCnt, int nodeCnt, int addedNo
         bool verify(OpBookCore& book, OpeningBoard& board, int sd, int ply, std::function<void(int, int, int, int)> reportNumbers);
 
     private:
-        std::map<u64, u64> m_keyMap;
+        // keys are appended while scanning games, then sorted and counted in bulk
+        std::vector<u64> m_pendingKeys[2];
+        i64 m_pendingLimit;
+
+        // building with a limited memory, sorted runs are spilt into temporary files
+        i64 m_memoryBudget;
+        std::string m_runPrefix;
+        std::vector<std::string> m_runPaths[2];
+        bool m_creatingFailed;
+
+        std::vector<u64> m_rootCandidateKeys;
+        std::set<u64> m_rootKeys[2];
 
         int m_reportFileCnt, m_reportCnt, m_reportNodeCnt;
 
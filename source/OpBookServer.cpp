@@ -0,0 +1,505 @@
+
+/*
+ This file is part of MoonRiver Xiangqi Opening Book, distributed under MIT license.
+
+ Copyright (c) 2018 Nguyen Hong Pham
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#include "OpBookServer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+using namespace opening;
+
+static_assert(sizeof(BookServerMessage) == 8, "BookServerMessage should be 8 bytes");
+static_assert(sizeof(int) == sizeof(i32), "values are sent as they are");
+
+#ifndef _WIN32
+
+#ifdef MSG_NOSIGNAL
+#define BOOK_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define BOOK_SEND_FLAGS 0
+#endif
+
+// Without MSG_NOSIGNAL (macOS) writing to a socket closed by its peer raises SIGPIPE, which would kill the process
+static void setNoSigPipe(int fd)
+{
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    ::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#else
+    (void)fd;
+#endif
+}
+
+static bool readAll(int fd, void* buf, size_t sz)
+{
+    auto p = (char*)buf;
+    while (sz > 0) {
+        auto n = ::recv(fd, p, sz, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n; sz -= n;
+    }
+    return true;
+}
+
+static bool writeAll(int fd, const void* buf, size_t sz)
+{
+    auto p = (const char*)buf;
+    while (sz > 0) {
+        auto n = ::send(fd, p, sz, BOOK_SEND_FLAGS);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n; sz -= n;
+    }
+    return true;
+}
+
+static bool makeAddress(const std::string& socketPath, sockaddr_un& addr)
+{
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socketPath.empty() || socketPath.size() >= sizeof(addr.sun_path)) {
+        if (openingVerbose) {
+            std::cerr << "Error: invalid socket path " << socketPath << std::endl;
+        }
+        return false;
+    }
+    memcpy(addr.sun_path, socketPath.c_str(), socketPath.size());
+    return true;
+}
+
+#endif
+
+///////////////////////////////////////////////////////////////////////
+
+OpBookServer::OpBookServer(const OpBookCore& _book)
+    : book(_book), listenFd(-1), stopping(false), requestCnt(0), keyCnt(0), busyTime(0)
+{
+}
+
+OpBookServer::~OpBookServer()
+{
+    closeAll();
+}
+
+#ifndef _WIN32
+
+bool OpBookServer::start(const std::string& _socketPath)
+{
+    closeAll();
+
+    sockaddr_un addr;
+    if (!makeAddress(_socketPath, addr)) {
+        return false;
+    }
+
+    listenFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+        return false;
+    }
+
+    // a socket file left by a server which was killed would stop binding
+    ::unlink(_socketPath.c_str());
+    if (::bind(listenFd, (const sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(listenFd, 64) != 0) {
+        if (openingVerbose) {
+            std::cerr << "Error: cannot listen on " << _socketPath << std::endl;
+        }
+        closeAll();
+        return false;
+    }
+
+    socketPath = _socketPath;
+    stopping = false;
+    return true;
+}
+
+void OpBookServer::run()
+{
+    std::vector<pollfd> pollFds;
+    std::vector<size_t> closingIdx;
+    while (!stopping && listenFd >= 0) {
+        pollFds.clear();
+        pollFds.push_back({ listenFd, POLLIN, 0 });
+        for(auto && conn : connections) {
+            // replies are sent before reading more, thus a client which doesn't read can't make the server buffer a lot
+            short events = conn.outputPos < conn.output.size() ? POLLOUT : POLLIN;
+            pollFds.push_back({ conn.fd, events, 0 });
+        }
+
+        // wakes up from time to time to check for stopping
+        auto r = ::poll(pollFds.data(), pollFds.size(), 200);
+        if (r <= 0) {
+            if (r < 0 && errno != EINTR) {
+                break;
+            }
+            continue;
+        }
+
+        closingIdx.clear();
+        for(size_t i = 1; i < pollFds.size(); i++) {
+            auto revents = pollFds[i].revents;
+            if (revents == 0) {
+                continue;
+            }
+            auto& conn = connections[i - 1];
+            auto ok = (revents & (POLLIN | POLLOUT)) != 0;
+            if (ok && (revents & POLLOUT)) {
+                ok = flush(conn);
+            }
+            if (ok && (revents & POLLIN)) {
+                ok = receive(conn) && serve(conn) && flush(conn);
+            }
+            if (!ok) {
+                closingIdx.push_back(i - 1);
+            }
+        }
+
+        for(auto it = closingIdx.rbegin(); it != closingIdx.rend(); ++it) {
+            ::close(connections[*it].fd);
+            connections.erase(connections.begin() + *it);
+        }
+
+        if (pollFds[0].revents & POLLIN) {
+            auto fd = ::accept(listenFd, nullptr, nullptr);
+            if (fd >= 0) {
+                auto flags = ::fcntl(fd, F_GETFL, 0);
+                if (flags < 0 || ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+                    ::close(fd);
+                } else {
+                    setNoSigPipe(fd);
+                    Connection conn;
+                    conn.fd = fd;
+                    conn.outputPos = 0;
+                    connections.push_back(conn);
+                }
+            }
+        }
+    }
+
+    if (openingVerbose) {
+        std::cerr << "Book server, requests: " << requestCnt << ", keys: " << keyCnt
+        << ", average service time: " << (requestCnt ? busyTime / requestCnt : 0) << " ns" << std::endl;
+    }
+
+    closeAll();
+}
+
+// Reads what the client has sent so far, returns false when the connection should be closed
+bool OpBookServer::receive(Connection& conn)
+{
+    const size_t chunkSz = 64 * 1024;
+    auto sz = conn.input.size();
+    conn.input.resize(sz + chunkSz);
+
+    auto n = ::recv(conn.fd, conn.input.data() + sz, chunkSz, 0);
+    conn.input.resize(sz + MAX(n, 0));
+
+    if (n < 0) {
+        return errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    return n > 0;
+}
+
+// Answers complete requests of the input, the rest waits for more bytes.
+// Returns false when the connection should be closed
+bool OpBookServer::serve(Connection& conn)
+{
+    size_t pos = 0;
+    while (conn.input.size() - pos >= sizeof(BookServerMessage)) {
+        BookServerMessage msg;
+        memcpy(&msg, conn.input.data() + pos, sizeof(msg));
+        if (msg.signature != BookServerMessage::Signature) {
+            return false;
+        }
+
+        size_t keySz = 0;
+        if (msg.command == BookServerMessage::CommandLookup) {
+            if (msg.count > MaxKeyNumber || msg.side > 1) {
+                return false;
+            }
+            keySz = msg.count * sizeof(u64);
+            if (conn.input.size() - pos < sizeof(msg) + keySz) {
+                break;
+            }
+        }
+
+        auto startTime = std::chrono::steady_clock::now();
+
+        BookServerMessage reply = msg;
+        reply.count = 0;
+
+        const void* body = nullptr;
+        size_t bodySz = 0;
+
+        switch (msg.command) {
+            case BookServerMessage::CommandInfo:
+                body = &book.getHeader()->signature;
+                bodySz = BookHeader::BookHeaderSz;
+                break;
+
+            case BookServerMessage::CommandLookup:
+                memcpy(keys, conn.input.data() + pos + sizeof(msg), keySz);
+                book.getValuesByKeys(keys, values, msg.count, msg.side);
+                reply.count = msg.count;
+                body = values;
+                bodySz = msg.count * sizeof(i32);
+                keyCnt += msg.count;
+                break;
+
+            default:
+                reply.command = BookServerMessage::CommandError;
+                break;
+        }
+
+        requestCnt++;
+        busyTime += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+
+        pos += sizeof(msg) + keySz;
+
+        auto p = (const char*)&reply;
+        conn.output.insert(conn.output.end(), p, p + sizeof(reply));
+        p = (const char*)body;
+        conn.output.insert(conn.output.end(), p, p + bodySz);
+    }
+
+    conn.input.erase(conn.input.begin(), conn.input.begin() + pos);
+    return true;
+}
+
+// Sends as much of the pending replies as the socket takes, returns false when the connection should be closed
+bool OpBookServer::flush(Connection& conn)
+{
+    while (conn.outputPos < conn.output.size()) {
+        auto n = ::send(conn.fd, conn.output.data() + conn.outputPos, conn.output.size() - conn.outputPos, BOOK_SEND_FLAGS);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        conn.outputPos += n;
+    }
+
+    conn.output.clear();
+    conn.outputPos = 0;
+    return true;
+}
+
+void OpBookServer::closeAll()
+{
+    for(auto && conn : connections) {
+        ::close(conn.fd);
+    }
+    connections.clear();
+
+    if (listenFd >= 0) {
+        ::close(listenFd);
+        listenFd = -1;
+        ::unlink(socketPath.c_str());
+    }
+    socketPath.clear();
+}
+
+#else
+
+bool OpBookServer::start(const std::string&)
+{
+    if (openingVerbose) {
+        std::cerr << "Error: book server is not supported on this system" << std::endl;
+    }
+    return false;
+}
+
+void OpBookServer::run()
+{
+}
+
+bool OpBookServer::receive(Connection&)
+{
+    return false;
+}
+
+bool OpBookServer::serve(Connection&)
+{
+    return false;
+}
+
+bool OpBookServer::flush(Connection&)
+{
+    return false;
+}
+
+void OpBookServer::closeAll()
+{
+}
+
+#endif
+
+///////////////////////////////////////////////////////////////////////
+
+OpBookClient::OpBookClient()
+    : fd(-1)
+{
+}
+
+OpBookClient::~OpBookClient()
+{
+    disconnect();
+}
+
+#ifndef _WIN32
+
+bool OpBookClient::connect(const std::string& socketPath)
+{
+    disconnect();
+
+    sockaddr_un addr;
+    if (!makeAddress(socketPath, addr)) {
+        return false;
+    }
+
+    fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return false;
+    }
+    setNoSigPipe(fd);
+
+    BookServerMessage msg;
+    msg.signature = BookServerMessage::Signature;
+    msg.command = BookServerMessage::CommandInfo;
+    msg.side = 0;
+    msg.count = 0;
+
+    // the header tells which keys the book has (canonical or not) and sizes of sides
+    auto ok = ::connect(fd, (const sockaddr*)&addr, sizeof(addr)) == 0
+        && request(msg, nullptr, 0, &header.signature, BookHeader::BookHeaderSz)
+        && header.isValid();
+
+    if (!ok) {
+        if (openingVerbose) {
+            std::cerr << "Error: cannot connect to book server " << socketPath << std::endl;
+        }
+        disconnect();
+        return false;
+    }
+
+    path = socketPath;
+    return true;
+}
+
+void OpBookClient::disconnect()
+{
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+bool OpBookClient::request(const BookServerMessage& msg, const void* body, size_t bodySz, void* replyBody, size_t replySz) const
+{
+    BookServerMessage reply;
+    auto ok = fd >= 0
+        && writeAll(fd, &msg, sizeof(msg))
+        && (bodySz == 0 || writeAll(fd, body, bodySz))
+        && readAll(fd, &reply, sizeof(reply))
+        && reply.signature == BookServerMessage::Signature
+        && reply.command == msg.command
+        && readAll(fd, replyBody, replySz);
+
+    if (!ok && fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+    return ok;
+}
+
+#else
+
+bool OpBookClient::connect(const std::string&)
+{
+    if (openingVerbose) {
+        std::cerr << "Error: book server is not supported on this system" << std::endl;
+    }
+    return false;
+}
+
+void OpBookClient::disconnect()
+{
+}
+
+bool OpBookClient::request(const BookServerMessage&, const void*, size_t, void*, size_t) const
+{
+    return false;
+}
+
+#endif
+
+int OpBookClient::getValueByKey(u64 key, int sd) const
+{
+    int value;
+    getValuesByKeys(&key, &value, 1, sd);
+    return value;
+}
+
+void OpBookClient::getValuesByKeys(const u64* keys, int* values, int n, int sd) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for(int i = 0; i < n; i += OpBookServer::MaxKeyNumber) {
+        auto cnt = MIN(n - i, OpBookServer::MaxKeyNumber);
+
+        BookServerMessage msg;
+        msg.signature = BookServerMessage::Signature;
+        msg.command = BookServerMessage::CommandLookup;
+        msg.side = (u8)sd;
+        msg.count = cnt;
+
+        if (!request(msg, keys + i, cnt * sizeof(u64), values + i, cnt * sizeof(i32))) {
+            if (openingVerbose) {
+                std::cerr << "Error: book server lookup failed" << std::endl;
+            }
+            std::fill(values + i, values + n, -1);
+            return;
+        }
+    }
+}
@@ -0,0 +1,126 @@
+
+/*
+ This file is part of MoonRiver Xiangqi Opening Book, distributed under MIT license.
+
+ Copyright (c) 2018 Nguyen Hong Pham
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#ifndef OpBookServer_hpp
+#define OpBookServer_hpp
+
+#include "OpBook.h"
+
+namespace opening {
+
+    // Messages between book servers and clients on the same host, in the byte order of the host.
+    // A lookup request is followed by count keys, its reply by count values (i32, -1 for missing keys).
+    // An info reply is followed by the book header, thus clients compute keys as the book does
+    class BookServerMessage {
+    public:
+        const static u16 Signature = 24680;
+
+        const static u8 CommandError = 0;
+        const static u8 CommandInfo = 1;
+        const static u8 CommandLookup = 2;
+
+        u16 signature;
+        u8  command;
+        u8  side;
+        u32 count;
+    };
+
+    // Daemon which loads a book once and answers lookups of local processes over a Unix domain socket.
+    // Clients are served in turn by one thread, a request takes a few microseconds. Sockets are non-blocking,
+    // bytes of a connection are kept until its request is complete, thus a slow client never holds up others
+    class OpBookServer {
+    public:
+        const static int MaxKeyNumber = 4 * 1024;
+
+        OpBookServer(const OpBookCore& book);
+        ~OpBookServer();
+
+        bool start(const std::string& socketPath);
+        void run();
+
+        // could be called from other threads or signal handlers, run() returns soon after that
+        void stop() {
+            stopping = true;
+        }
+
+        i64 getRequestCount() const {
+            return requestCnt;
+        }
+
+    private:
+        class Connection {
+        public:
+            int fd;
+            std::vector<char> input, output; // received bytes of incomplete requests, replies not sent yet
+            size_t outputPos;
+        };
+
+        OpBookServer(const OpBookServer&);
+        OpBookServer& operator = (const OpBookServer&);
+
+        bool receive(Connection& conn);
+        bool serve(Connection& conn);
+        bool flush(Connection& conn);
+        void closeAll();
+
+        const OpBookCore& book;
+        std::string socketPath;
+        int listenFd;
+        std::vector<Connection> connections;
+        std::atomic<bool> stopping;
+
+        u64 keys[MaxKeyNumber];
+        int values[MaxKeyNumber];
+
+        i64 requestCnt, keyCnt, busyTime; // busy time in nanoseconds
+    };
+
+    // Book whose lookups are answered by a book server. It probes with the same functions as other books,
+    // only values are read from the server. Calls of a client are serialised, threads may have their own ones
+    class OpBookClient : public OpBookCore {
+    public:
+        OpBookClient();
+        virtual ~OpBookClient();
+
+        bool connect(const std::string& socketPath);
+        void disconnect();
+
+        bool isConnected() const {
+            return fd >= 0;
+        }
+
+        virtual int getValueByKey(u64 key, int sd) const;
+        virtual void getValuesByKeys(const u64* keys, int* values, int n, int sd) const;
+
+    private:
+        bool request(const BookServerMessage& msg, const void* body, size_t bodySz, void* reply, size_t replySz) const;
+
+        mutable std::mutex mutex;
+        mutable int fd; // closed when a request fails, the stream can't be followed any more
+    };
+
+} // namespace opening
+
+#endif /* OpBookServer_hpp */
@@ -0,0 +1,130 @@
+
+/*
+ This file is part of MoonRiver Xiangqi Opening Book, distributed under MIT license.
+
+ Copyright (c) 2018 Nguyen Hong Pham
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#include "OpBookSession.h"
+
+using namespace opening;
+
+BookSession::BookSession(const OpBookCore& _book, const std::string& fen)
+    : book(_book), leftBookPly(-1)
+{
+    newGame(fen);
+}
+
+void BookSession::newGame(const std::string& fen)
+{
+    board.newGame(fen);
+    keyStack.clear();
+    leftBookPly = -1;
+}
+
+void BookSession::push(const Move& move)
+{
+    push(move.from, move.dest);
+}
+
+void BookSession::push(int from, int dest)
+{
+    PositionKeys positionKeys;
+    for(int i = 0; i < 4; i++) {
+        positionKeys.keys[i] = board.key(static_cast<FlipMode>(i));
+    }
+    keyStack.push_back(positionKeys);
+
+    board.make(from, dest);
+}
+
+void BookSession::pop()
+{
+    if (board.getPly() == 0) {
+        return;
+    }
+    board.takeBack();
+    keyStack.pop_back();
+
+    // back to a position which was in book
+    if (leftBookPly > getPly()) {
+        leftBookPly = -1;
+    }
+}
+
+Move BookSession::probe(MoveList* opMoveList)
+{
+    if (isOutOfBook()) {
+        if (opMoveList) {
+            opMoveList->reset();
+        }
+        if (!isPositionInBook()) {
+            return Move(-1, -1);
+        }
+    }
+
+    // the ply where the game left the book is kept until it comes back
+    auto bestmove = book.probe(board, opMoveList);
+    if (bestmove.isValid()) {
+        leftBookPly = -1;
+    } else if (leftBookPly < 0) {
+        leftBookPly = getPly();
+    }
+    return bestmove;
+}
+
+// The book keeps positions after moves of sides it has been built for. A game which comes back
+// to the book by a transposition reaches either a position of the book (after a move of the other side)
+// or one whose parent is there (after a move of the side to move, which has been kept)
+bool BookSession::isPositionInBook() const
+{
+    auto sd = static_cast<int>(board.side), xsd = 1 - sd;
+    auto hasParent = !keyStack.empty();
+    const u64* parentKeys = hasParent ? keyStack.back().keys : nullptr;
+
+    u64 keys[4];
+    int values[4];
+
+    // flipped keys as the probe tries them, colours are swapped by vertical flips and rotations.
+    // Canonical keys are the smaller ones of the pairs of horizontal mirrors (none and horizontal, vertical and rotate)
+    auto canonical = book.getHeader()->isCanonicalKeys();
+    for(int k = 0; k < 2; k++) {
+        auto data = k == 0 ? xsd : sd;
+        int n = 0;
+        for(int i = 0; i < 4; i += canonical ? 2 : 1) {
+            auto colourSwapped = i >= static_cast<int>(FlipMode::vertical);
+            if ((k == 1) == colourSwapped) {
+                auto key = board.key(static_cast<FlipMode>(i));
+                keys[n++] = canonical ? MIN(key, board.key(static_cast<FlipMode>(i + 1))) : key;
+            } else if (hasParent) {
+                keys[n++] = canonical ? MIN(parentKeys[i], parentKeys[i + 1]) : parentKeys[i];
+            }
+        }
+
+        book.getValuesByKeys(keys, values, n, data);
+        for(int i = 0; i < n; i++) {
+            if (values[i] >= 0) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
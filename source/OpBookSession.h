@@ -0,0 +1,83 @@
+
+/*
+ This file is part of MoonRiver Xiangqi Opening Book, distributed under MIT license.
+
+ Copyright (c) 2018 Nguyen Hong Pham
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#ifndef OpBookSession_hpp
+#define OpBookSession_hpp
+
+#include "OpBook.h"
+#include "OpBoard.h"
+
+namespace opening {
+
+    // Probing along a game. The board is updated move by move instead of being set up for each probe.
+    // Once a probe finds no move, the game is out of book: later probes only check whether the position
+    // itself is in the book (reached by a transposition) before probing again
+    class BookSession {
+    public:
+        BookSession(const OpBookCore& book, const std::string& fen = "");
+
+        void newGame(const std::string& fen = "");
+
+        void push(const Move& move);
+        void push(int from, int dest);
+        void pop();
+
+        Move probe(MoveList* opMoveList = nullptr);
+
+        bool isOutOfBook() const {
+            return leftBookPly >= 0;
+        }
+
+        // ply of the position where the last probe failed, -1 when the game is still in book
+        int getLeftBookPly() const {
+            return leftBookPly;
+        }
+
+        int getPly() const {
+            return board.getPly();
+        }
+
+        const OpeningBoard& getBoard() const {
+            return board;
+        }
+
+    private:
+        bool isPositionInBook() const;
+
+        // keys of a position in all flip modes, kept for positions before moves
+        class PositionKeys {
+        public:
+            u64 keys[4];
+        };
+
+        const OpBookCore& book;
+        OpeningBoard board;
+        std::vector<PositionKeys> keyStack;
+        int leftBookPly;
+    };
+
+} // namespace opening
+
+#endif /* OpBookSession_hpp */
@@ -0,0 +1,284 @@
+
+/*
+ This file is part of MoonRiver Xiangqi Opening Book, distributed under MIT license.
+
+ Copyright (c) 2018 Nguyen Hong Pham
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#include "OpPerft.h"
+
+#include <chrono>
+#include <iomanip>
+
+using namespace opening;
+
+static const int PerftMaxDepth = 5;
+
+// Counts of the start position are the published ones. Others are regression counts: they were computed
+// by this code and only agree between its two generators, thus a bug of both would not be caught by them
+class PerftPosition {
+public:
+    const char* fen;
+    i64 counts[PerftMaxDepth]; // by depths from 1, 0 when not known
+    bool published;
+};
+
+static const PerftPosition perftSuite[] = {
+    { "rheakaehr/9/1c5c1/p1p1p1p1p/9/9/P1P1P1P1P/1C5C1/9/RHEAKAEHR w", { 44, 1920, 79666, 3290240, 133312995 }, true },
+    { "r1eakaer1/9/1c2c1h2/p1p1h3p/9/9/P1P3R1P/1CH1C1H2/4A4/R1EAK1E2 w", { 39, 1436, 57244, 2204569, 90247237 }, false },
+    { "r1eak1er1/4a1c2/4c3h/pC2h2C1/2p1p3p/6R2/P1P1P1P1P/2H1E1H2/7R1/3AKAE2 w", { 60, 2101, 120633, 4455506, 245906238 }, false },
+    { "2raka3/3r5/4e4/pH5cp/5h3/P2hR4/R7P/1C2E1H2/4A4/4KAE2 w", { 47, 2348, 105550, 5049606, 222951185 }, false },
+    { "3aka3/4c4/2R1e4/p1Cr5/2P5p/6E2/P7P/2H6/9/c3KAE2 w", { 5, 170, 3307, 111735, 2706193 }, false },        // in check
+    { "Rhe1ka3/4a4/4e1h2/2C1p1Ccp/1rpH2c2/2P6/4P3P/4E4/2H1A4/4KAE2 b", { 39, 1387, 55575, 2028158, 82394227 }, false },
+};
+
+static double elapsedSeconds(std::chrono::steady_clock::time_point startTime)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+static std::string perSecond(i64 cnt, double seconds)
+{
+    std::ostringstream stringStream;
+    stringStream << std::fixed << std::setprecision(2) << (seconds > 0 ? cnt / seconds / 1000000 : 0) << " M/s";
+    return stringStream.str();
+}
+
+i64 OpPerft::perft(PositionCore& position, int depth, bool byMaking)
+{
+    if (depth <= 0) {
+        return 1;
+    }
+
+    auto side = position.side;
+    MoveList moves;
+    if (byMaking) {
+        MoveList moveList;
+        position.gen(moveList, side);
+        for(int i = 0; i < moveList.end; i++) {
+            auto cap = position.make(moveList.list[i]);
+            if (!position.isIncheck(side)) {
+                moves.add(moveList.list[i]);
+            }
+            position.takeBack(moveList.list[i], cap);
+        }
+    } else {
+        position.genLegal(moves, side);
+    }
+
+    // leaves are counted without being made
+    if (depth == 1) {
+        return moves.end;
+    }
+
+    i64 nodes = 0;
+    for(int i = 0; i < moves.end; i++) {
+        auto cap = position.make(moves.list[i]);
+        position.side = getXSide(side);
+        nodes += perft(position, depth - 1, byMaking);
+        position.side = side;
+        position.takeBack(moves.list[i], cap);
+    }
+    return nodes;
+}
+
+void OpPerft::divide(PositionCore& position, int depth)
+{
+    auto side = position.side;
+    MoveList moves;
+    position.genLegal(moves, side);
+
+    auto startTime = std::chrono::steady_clock::now();
+    i64 total = 0;
+    for(int i = 0; i < moves.end; i++) {
+        auto move = moves.list[i];
+        auto cap = position.make(move);
+        position.side = getXSide(side);
+        auto nodes = perft(position, depth - 1);
+        position.side = side;
+        position.takeBack(move, cap);
+
+        std::cout << posToCoordinateString(move.from) << posToCoordinateString(move.dest) << ": " << nodes << std::endl;
+        total += nodes;
+    }
+
+    auto seconds = elapsedSeconds(startTime);
+    std::cout << "moves: " << moves.end << ", nodes: " << total << ", time: " << seconds << " s, " << perSecond(total, seconds) << std::endl;
+}
+
+bool OpPerft::checkSuite(int maxDepth)
+{
+    bool ok = true;
+    for(auto && suite : perftSuite) {
+        PositionCore position;
+        if (!position.setFen(suite.fen)) {
+            std::cerr << "Error: invalid FEN " << suite.fen << std::endl;
+            return false;
+        }
+
+        std::cout << suite.fen << (suite.published ? "" : " (regression counts)") << std::endl;
+
+        // generators are compared on the tree of a smaller depth
+        if (!crossCheckGen(position, MIN(maxDepth, PerftMaxDepth) - 1)) {
+            std::cout << "\tERROR: generators give different moves or checks" << std::endl;
+            ok = false;
+        }
+
+        for(int depth = 1; depth <= MIN(maxDepth, PerftMaxDepth) && suite.counts[depth - 1] > 0; depth++) {
+            auto startTime = std::chrono::steady_clock::now();
+            auto nodes = perft(position, depth);
+            auto seconds = elapsedSeconds(startTime);
+
+            auto good = nodes == suite.counts[depth - 1];
+            ok = ok && good;
+            std::cout << "\tdepth " << depth << ": " << nodes << (good ? "" : " ERROR, expected ") ;
+            if (!good) {
+                std::cout << suite.counts[depth - 1];
+            }
+            std::cout << ", " << perSecond(nodes, seconds) << std::endl;
+        }
+    }
+
+    std::cout << (ok ? "Perft: all counts are correct" : "Perft: some counts are WRONG") << std::endl;
+    return ok;
+}
+
+bool OpPerft::crossCheckGen(PositionCore& position, int depth)
+{
+    if (!position.crossCheckGen(position.side)) {
+        return false;
+    }
+    if (depth <= 0) {
+        return true;
+    }
+
+    auto side = position.side;
+    MoveList moves;
+    position.genLegal(moves, side);
+    bool ok = true;
+    for(int i = 0; i < moves.end && ok; i++) {
+        auto cap = position.make(moves.list[i]);
+        position.side = getXSide(side);
+        ok = crossCheckGen(position, depth - 1);
+        position.side = side;
+        position.takeBack(moves.list[i], cap);
+    }
+    return ok;
+}
+
+void OpPerft::collectPositions(PositionCore& position, int depth, std::vector<PositionCore>& positions, size_t maxSize)
+{
+    if (positions.size() >= maxSize) {
+        return;
+    }
+    positions.push_back(position);
+    if (depth <= 0) {
+        return;
+    }
+
+    auto side = position.side;
+    MoveList moves;
+    position.genLegal(moves, side);
+    for(int i = 0; i < moves.end && positions.size() < maxSize; i++) {
+        auto cap = position.make(moves.list[i]);
+        position.side = getXSide(side);
+        collectPositions(position, depth - 1, positions, maxSize);
+        position.side = side;
+        position.takeBack(moves.list[i], cap);
+    }
+}
+
+void OpPerft::bench(int depth)
+{
+#ifdef OPENING_BITBOARD_MOVEGEN
+    std::cout << "Move generator: bitboards" << std::endl;
+#else
+    std::cout << "Move generator: squares" << std::endl;
+#endif
+
+    // perft, legal moves by CheckInfo and by making moves
+    std::vector<PositionCore> positions;
+    for(auto && suite : perftSuite) {
+        PositionCore position;
+        position.setFen(suite.fen);
+
+        for(int byMaking = 0; byMaking < 2; byMaking++) {
+            auto startTime = std::chrono::steady_clock::now();
+            auto nodes = perft(position, depth, byMaking != 0);
+            auto seconds = elapsedSeconds(startTime);
+            std::cout << "perft " << depth << (byMaking ? " (making)   " : " (CheckInfo)") << ": " << nodes << " nodes, "
+            << seconds << " s, " << perSecond(nodes, seconds) << ", " << suite.fen << std::endl;
+        }
+
+        collectPositions(position, 3, positions, positions.size() + 50000);
+    }
+
+    // generating and in-check detection only, on positions of the trees above
+    const int rounds = 20;
+    i64 cnt = 0;
+    MoveList moves;
+
+    auto startTime = std::chrono::steady_clock::now();
+    for(int r = 0; r < rounds; r++) {
+        for(auto && position : positions) {
+            position.gen(moves, position.side);
+            cnt += moves.end;
+        }
+    }
+    auto seconds = elapsedSeconds(startTime);
+    i64 n = rounds * (i64)positions.size();
+    std::cout << "gen: " << n << " positions, " << cnt << " moves, " << perSecond(n, seconds) << " positions, " << perSecond(cnt, seconds) << " moves" << std::endl;
+
+#ifdef OPENING_BITBOARD_MOVEGEN
+    cnt = 0;
+    startTime = std::chrono::steady_clock::now();
+    for(int r = 0; r < rounds; r++) {
+        for(auto && position : positions) {
+            position.genBySquares(moves, position.side);
+            cnt += moves.end;
+        }
+    }
+    seconds = elapsedSeconds(startTime);
+    std::cout << "genBySquares: " << n << " positions, " << cnt << " moves, " << perSecond(n, seconds) << " positions, " << perSecond(cnt, seconds) << " moves" << std::endl;
+#endif
+
+    cnt = 0;
+    startTime = std::chrono::steady_clock::now();
+    for(int r = 0; r < rounds; r++) {
+        for(auto && position : positions) {
+            cnt += position.isIncheck(Side::black) + position.isIncheck(Side::white);
+        }
+    }
+    seconds = elapsedSeconds(startTime);
+    std::cout << "isIncheck: " << 2 * n << " tests, " << cnt << " checks, " << perSecond(2 * n, seconds) << std::endl;
+
+#ifdef OPENING_BITBOARD_MOVEGEN
+    cnt = 0;
+    startTime = std::chrono::steady_clock::now();
+    for(int r = 0; r < rounds; r++) {
+        for(auto && position : positions) {
+            cnt += position.occupancy.isIncheck(position, Side::black) + position.occupancy.isIncheck(position, Side::white);
+        }
+    }
+    seconds = elapsedSeconds(startTime);
+    std::cout << "isIncheck by bitboards: " << 2 * n << " tests, " << cnt << " checks, " << perSecond(2 * n, seconds) << std::endl;
+#endif
+}
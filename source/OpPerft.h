@@ -0,0 +1,58 @@
+
+/*
+ This file is part of MoonRiver Xiangqi Opening Book, distributed under MIT license.
+
+ Copyright (c) 2018 Nguyen Hong Pham
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#ifndef OpPerft_hpp
+#define OpPerft_hpp
+
+#include "OpBoard.h"
+
+namespace opening {
+
+    // Perft counts leaves of the legal move tree of a position to a given depth. Counts of a few positions
+    // are stored (published ones or regression ones), any change of generating, making or legality checking
+    // which breaks them is a bug.
+    // The benchmark times perft, generating and in-check detection thus generators could be compared
+    class OpPerft {
+    public:
+        // legal moves are found by CheckInfo or by making them and testing checks
+        static i64 perft(PositionCore& position, int depth, bool byMaking = false);
+
+        // counts under each legal move of the position
+        static void divide(PositionCore& position, int depth);
+
+        // compares perft of known positions with their counts up to a depth, returns false on any difference
+        static bool checkSuite(int maxDepth);
+
+        static void bench(int depth);
+
+    private:
+        // both move generators give the same moves on all nodes of the tree of a position
+        static bool crossCheckGen(PositionCore& position, int depth);
+        static void collectPositions(PositionCore& position, int depth, std::vector<PositionCore>& positions, size_t maxSize);
+    };
+
+} // namespace opening
+
+#endif /* OpPerft_hpp */
@@ -38,6 +38,9 @@
 #include <glob.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <fstream>
 
 #endif
@@ -113,13 +116,13 @@ namespace opening {
 
     void toLower(std::string& str) {
         for(int i = 0; i < str.size(); ++i) {
-            str[i] = tolower(str[i]);
+            str[i] = tolower((unsigned char)str[i]);
         }
     }
 
     void toLower(char* str) {
         for(int i = 0; str[i]; ++i) {
-            str[i] = tolower(str[i]);
+            str[i] = tolower((unsigned char)str[i]);
         }
     }
 
@@ -208,6 +211,128 @@ namespace opening {
         return vec;
     }
 
+#endif
+
+    /*
+     * Memory mapped files
+     */
+    MemMappedFile::MemMappedFile()
+        : data(nullptr), size(0), releasedSize(0)
+#ifdef _WIN32
+        , fileHandle(INVALID_HANDLE_VALUE), mapHandle(nullptr)
+#endif
+    {
+    }
+
+    MemMappedFile::~MemMappedFile()
+    {
+        close();
+    }
+
+#ifdef _WIN32
+    bool MemMappedFile::open(const std::string& path)
+    {
+        close();
+
+        fileHandle = CreateFile(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (fileHandle == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(fileHandle, &fileSize) || fileSize.QuadPart == 0) {
+            close();
+            return false;
+        }
+
+        mapHandle = CreateFileMapping(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapHandle == nullptr) {
+            close();
+            return false;
+        }
+
+        data = (const char*)MapViewOfFile(mapHandle, FILE_MAP_READ, 0, 0, 0);
+        if (data == nullptr) {
+            close();
+            return false;
+        }
+
+        size = fileSize.QuadPart;
+        return true;
+    }
+
+    void MemMappedFile::close()
+    {
+        if (data) {
+            UnmapViewOfFile(data);
+            data = nullptr;
+        }
+        if (mapHandle) {
+            CloseHandle(mapHandle);
+            mapHandle = nullptr;
+        }
+        if (fileHandle != INVALID_HANDLE_VALUE) {
+            CloseHandle(fileHandle);
+            fileHandle = INVALID_HANDLE_VALUE;
+        }
+        size = releasedSize = 0;
+    }
+
+    // The system trims pages of views by itself
+    void MemMappedFile::release(i64)
+    {
+    }
+
+#else
+    bool MemMappedFile::open(const std::string& path)
+    {
+        close();
+
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+
+        void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+        // the mapping keeps its own reference to the file
+        ::close(fd);
+
+        if (p == MAP_FAILED) {
+            return false;
+        }
+
+        data = (const char*)p;
+        size = st.st_size;
+        return true;
+    }
+
+    void MemMappedFile::close()
+    {
+        if (data) {
+            munmap((void*)data, (size_t)size);
+            data = nullptr;
+        }
+        size = releasedSize = 0;
+    }
+
+    // Pages of a read-only file mapping are clean, they are read from the file again if touched
+    void MemMappedFile::release(i64 offset)
+    {
+        const i64 step = 4 * 1024 * 1024; // a multiple of page sizes
+        offset = MIN(offset, size) / step * step;
+        if (data && offset > releasedSize) {
+            madvise((void*)(data + releasedSize), (size_t)(offset - releasedSize), MADV_DONTNEED);
+            releasedSize = offset;
+        }
+    }
+
 #endif
 
 //    static void * _allocForLzma(ISzAllocPtr, size_t size) { return malloc(size); }
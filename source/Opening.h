@@ -36,6 +36,9 @@ namespace opening {
 
 #define OPENING_VERSION                    0x100
 
+// Build with it to generate moves and detect checks with bitboards instead of walking squares
+//#define OPENING_BITBOARD_MOVEGEN
+
 
     ////////////////////////////////////////
 #define MIN(a, b)                       (((a) <= (b)) ? (a) : (b))
@@ -143,6 +146,39 @@ namespace opening {
     std::string getVersion();
     std::vector<std::string> listdir(std::string dirname);
 
+    // Read-only mapping of a whole file into memory. Pages are shared with
+    // other processes which map the same file
+    class MemMappedFile {
+    public:
+        MemMappedFile();
+        ~MemMappedFile();
+
+        bool open(const std::string& path);
+        void close();
+
+        // Data before the offset won't be read again, its pages are dropped from memory in steps
+        void release(i64 offset);
+
+        const char* getData() const {
+            return data;
+        }
+        i64 getSize() const {
+            return size;
+        }
+
+    private:
+        MemMappedFile(const MemMappedFile&);
+        MemMappedFile& operator = (const MemMappedFile&);
+
+        const char* data;
+        i64 size, releasedSize;
+
+#ifdef _WIN32
+        void* fileHandle;
+        void* mapHandle;
+#endif
+    };
+
     int decompress(char *dst, int uncompresslen, const char *src, int slen);
     i64 decompressAllBlocks(int blocksize, int blocknum, u32* blocktable, char *dest, i64 uncompressedlen, const char *src, i64 slen);
 
@@ -155,6 +191,7 @@ namespace opening {
     class Piece;
     class Move;
     class MoveList;
+    class PositionCore;
     class OpeningBoard;
 
 } // namespace egtb
@@ -8,21 +8,50 @@
 
 #include <iostream>
 #include <map>
+#include <csignal>
 
 #include "OpBoard.h"
 #include "OpBookBuilder.h"
+#include "OpBookServer.h"
+#include "OpPerft.h"
+
+static const std::string defaultSocketPath = "/tmp/opening-book.sock";
+static opening::OpBookServer* bookServer = nullptr;
+
+static void stopBookServer(int)
+{
+    if (bookServer) {
+        bookServer->stop();
+    }
+}
 
 static void show_usage(std::string name)
 {
-    std::cerr << "Usage: " << name << " [-h] [-f inputpath] [-d directory] [-o outputpath] [-i info-copyright] [-max-fly fly] [-min-game number] [-only-white] [-only-black] [-uniform]" << std::endl;
+    std::cerr << "Usage: " << name << " [-h] [-f inputpath] [-d directory] [-o outputpath] [-i info-copyright] [-max-ply ply] [-min-ply ply] [-min-game number] [-only-white] [-only-black] [-uniform] [-aligned] [-threads number] [-memory MB] [-hashed] [-bloom] [-canonical] [-convert bookpath] [-verify bookpath] [-serve bookpath] [-socket path] [-mmap] [-index] [-perft depth] [-fen fen] [-divide] [-perft-suite] [-bench]" << std::endl;
     std::cerr << "Options:\n"
     << "\t-h,--help\t\tshow this help message and exit\n"
     << "\t-f\t\tinput path\n"
     << "\t-d\t\tinput directory\n"
     << "\t-o\t\toutput path\n"
     << "\t-i\t\tinfo/copyright string\n"
-    << "\t-max-fly\t\tplies (half moves) to add for each game (default: infinite)\n"
+    << "\t-max-ply\t\tplies (half moves) to add for each game (default: 20)\n"
+    << "\t-min-ply\t\tgames shorter than that number of plies are ignored (default: 20)\n"
     << "\t-min-game\t\tnumber of moves to be played to be kept in the book (default: 3)\n"
+    << "\t-aligned\t\tstart data at page boundaries, the book could be loaded with memory mapping\n"
+    << "\t-threads\t\tnumber of threads to read game files (default: 1)\n"
+    << "\t-memory\t\t\tmemory budget in MB for building large books, data is sorted in runs in temporary files, not with -hashed (default: no limit)\n"
+    << "\t-hashed\t\t\tstore data in hash tables instead of sorted arrays, faster to probe, larger files\n"
+    << "\t-bloom\t\t\tstore a Bloom filter in the book to reject quickly positions out of book, about 1.25 bytes per item\n"
+    << "\t-canonical\t\tstore positions and their mirrored ones under the same keys, books are smaller\n"
+    << "\t-convert\t\tconvert a book between sorted and hashed data (with -hashed), write to the output path, -bloom adds a filter\n"
+    << "\t-verify\t\t\tcheck data of a book, its search index and which items are reachable from the start position\n"
+    << "\t-serve\t\t\tload a book once and answer lookups of local engines (OpBookClient) until being interrupted\n"
+    << "\t-socket\t\t\tUnix domain socket path of the book server (default: " << defaultSocketPath << ")\n"
+    << "\t-mmap\t\t\tmap the served book instead of reading it into memory\n"
+    << "\t-index\t\t\tbuild a search index of the served book, faster lookups of large books, about 8 bytes per item\n"
+    << "\t-perft\t\t\tcount legal move paths of a position (-fen, default: start position) to a depth, -divide counts under each move\n"
+    << "\t-perft-suite\t\tcompare perft of known positions with their counts, up to the depth of -perft (default: 4)\n"
+    << "\t-bench\t\t\ttime perft, generating and in-check detection, to the depth of -perft (default: 4)\n"
     << std::endl
     << "\tExample: opening -d c:\\games -o c:\\opening.xob \n"
 
@@ -38,7 +67,8 @@ int main(int argc, const char * argv[]) {
     std::map<std::string, std::string> paramMap;
 
     const char* singleParaNames[] = {
-        "-only-white", "-only-black", "merge-book", "-uniform",
+        "-only-white", "-only-black", "merge-book", "-uniform", "-aligned", "-hashed", "-bloom", "-canonical", "-mmap", "-index",
+        "-divide", "-perft-suite", "-bench",
         nullptr
     };
 
@@ -51,6 +81,14 @@ int main(int argc, const char * argv[]) {
         "-min-ply", "minply",
         "-min-game", "mingame",
         "-i", "info",
+        "-threads", "threads",
+        "-memory", "memory",
+        "-convert", "convert",
+        "-verify", "verify",
+        "-serve", "serve",
+        "-socket", "socket",
+        "-perft", "perft",
+        "-fen", "fen",
 
         nullptr, nullptr
     };
@@ -75,7 +113,7 @@ int main(int argc, const char * argv[]) {
         for(int j = 0; pairParaNames[j]; j += 2) {
             if (arg == pairParaNames[j]) {
                 if (i + 1 < argc) { // Make sure we aren't at the end of argv!
-                    auto destination = argv[i++]; // Increment 'i' so we don't get the argument as the next argv[i].
+                    auto destination = argv[++i]; // Increment 'i' so we don't get the argument as the next argv[i].
                     paramMap[pairParaNames[j + 1]] = destination;
                 } else {
                     std::cerr << pairParaNames[j] << " option requires one argument." << std::endl;
@@ -93,29 +131,92 @@ int main(int argc, const char * argv[]) {
 //    board.setFen("");
 //    std::cout << "Origin hashKey = " << board.key() << std::endl;
 
-    opening::OpBookBuilder opBookBuilder;
+    auto it = paramMap.find("convert");
+    if (it != paramMap.end()) {
+        auto outIt = paramMap.find("out");
+        if (outIt == paramMap.end()) {
+            show_usage(argv[0]);
+            return 1;
+        }
+        auto hashed = paramMap.find("-hashed") != paramMap.end();
+        if (!opening::OpBookCore::convert(it->second, outIt->second, hashed)
+            || (paramMap.find("-bloom") != paramMap.end() && !opening::OpBookCore::addBloomFilter(outIt->second))) {
+            std::cerr << "Error: cannot convert " << it->second << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    it = paramMap.find("verify");
+    if (it != paramMap.end()) {
+        paramMap["out"] = it->second;
+        opening::OpBookBuilder opBookBuilder;
+        opBookBuilder.verify(paramMap, [](std::string msg) { std::cout << msg << std::endl; });
+        return 0;
+    }
 
-//    paramMap["file"] = "/Users/TonyPham/workspace/Opening/testgame/workinggame.pgn";
-//    paramMap["file"] = "/Users/TonyPham/workspace/Opening/testgame/MyTestRule.pgn";
-//    paramMap["file"] = "/Users/TonyPham/workspace/Opening/testgame/chasegames.pgn";
-//    paramMap["file"] = "/Users/TonyPham/workspace/Opening/testgame/AsiaRule.pgn";
+    it = paramMap.find("serve");
+    if (it != paramMap.end()) {
+        opening::OpBook book;
+        if (!book.load(it->second, paramMap.find("-mmap") != paramMap.end(), paramMap.find("-index") != paramMap.end())) {
+            std::cerr << "Error: cannot load " << it->second << std::endl;
+            return 1;
+        }
 
-//    paramMap["file"] = "/Users/TonyPham/workspace/Opening/testgame/chasing04.pgn";
-    paramMap["folder"] = "/Users/TonyPham/workspace/Opening/testgame";
+        auto socketIt = paramMap.find("socket");
+        auto socketPath = socketIt != paramMap.end() ? socketIt->second : defaultSocketPath;
 
-    paramMap["out"] = "/Users/TonyPham/workspace/Opening/o.xob";
-    paramMap["-only-white"] = "1";
-    opBookBuilder.create(paramMap);
+        opening::OpBookServer server(book);
+        if (!server.start(socketPath)) {
+            std::cerr << "Error: cannot start book server on " << socketPath << std::endl;
+            return 1;
+        }
 
-    opening::OpBook opBook;
-    opBook.load("/Users/TonyPham/workspace/Opening/o.xob");
-    opBook.verifyData();
+        bookServer = &server;
+        signal(SIGINT, stopBookServer);
+        signal(SIGTERM, stopBookServer);
 
-    opening::OpeningBoard board;
-    board.setFen("");
+        std::cout << "Serving " << it->second << " on " << socketPath << std::endl;
+        server.run();
+        bookServer = nullptr;
+        return 0;
+    }
 
-    auto move = opBook.probe(board);
-    std::cout << "opening move = " << move.toString() << std::endl;
+    it = paramMap.find("perft");
+    auto perftDepth = it != paramMap.end() ? atoi(it->second.c_str()) : 4;
+
+    if (paramMap.find("-perft-suite") != paramMap.end()) {
+        return opening::OpPerft::checkSuite(perftDepth) ? 0 : 1;
+    }
+
+    if (paramMap.find("-bench") != paramMap.end()) {
+        opening::OpPerft::bench(perftDepth);
+        return 0;
+    }
+
+    if (it != paramMap.end()) {
+        auto fenIt = paramMap.find("fen");
+        opening::PositionCore position;
+        if (!position.setFen(fenIt != paramMap.end() ? fenIt->second.c_str() : "")) {
+            std::cerr << "Error: invalid FEN " << fenIt->second << std::endl;
+            return 1;
+        }
+
+        if (paramMap.find("-divide") != paramMap.end()) {
+            opening::OpPerft::divide(position, perftDepth);
+        } else {
+            std::cout << "perft " << perftDepth << ": " << opening::OpPerft::perft(position, perftDepth) << std::endl;
+        }
+        return 0;
+    }
+
+    if (paramMap.find("folder") == paramMap.end() && paramMap.find("file") == paramMap.end()) {
+        show_usage(argv[0]);
+        return 1;
+    }
+
+    opening::OpBookBuilder opBookBuilder;
+    opBookBuilder.create(paramMap);
 
     return 0;
 }